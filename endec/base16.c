@@ -0,0 +1,460 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - base16 kernels, with and without colons
+ *
+ * The vector kernels handle whole blocks in the middle of the data, and
+ * the scalar code handles the ends, including the separators and errors.
+ */
+
+#include <apr.h>
+#include <apr_encode.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+static const char base16[] = "0123456789ABCDEF";
+static const char base16lower[] = "0123456789abcdef";
+
+/*
+ * Encode whole blocks, returning the number of bytes consumed. Colon
+ * kernels write each byte followed by a colon, and so must leave at least
+ * one byte behind them.
+ */
+typedef apr_size_t (*encode_fn)(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet);
+
+/*
+ * Decode whole blocks, stopping short of any block that holds an invalid
+ * character. Returns the number of characters consumed. Colon kernels
+ * consume each pair along with the colon that follows it, and so must
+ * leave at least one pair behind them.
+ */
+typedef apr_size_t (*decode_fn)(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen);
+
+static int hexval(unsigned char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static apr_size_t encode_none(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    return 0;
+}
+
+static apr_size_t decode_none(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    return 0;
+}
+
+#if ENDEC_X86
+
+__attribute__((target("sse4.1")))
+static inline void encode_sse41_pairs(__m128i in, __m128i lookup,
+        __m128i *lo, __m128i *hi)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i high, low;
+
+    high = _mm_shuffle_epi8(lookup,
+            _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+    low = _mm_shuffle_epi8(lookup, _mm_and_si128(in, mask));
+
+    *lo = _mm_unpacklo_epi8(high, low);
+    *hi = _mm_unpackhi_epi8(high, low);
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t encode_sse41(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    const __m128i lookup = _mm_loadu_si128((const __m128i *)alphabet);
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 16; i += 16) {
+        __m128i lo, hi;
+
+        encode_sse41_pairs(_mm_loadu_si128((const __m128i *)(src + i)),
+                lookup, &lo, &hi);
+
+        _mm_storeu_si128((__m128i *)dest, lo);
+        _mm_storeu_si128((__m128i *)(dest + 16), hi);
+        dest += 32;
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t encode_colon_sse41(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    const __m128i lookup = _mm_loadu_si128((const __m128i *)alphabet);
+    apr_size_t i;
+
+    /* spread sixteen pairs over forty eight characters, "XX:" each */
+    for (i = 0; slen - i > 16; i += 16) {
+        __m128i lo, hi, out;
+
+        encode_sse41_pairs(_mm_loadu_si128((const __m128i *)(src + i)),
+                lookup, &lo, &hi);
+
+        out = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(0, 1, -1, 2,
+                3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10)),
+                _mm_setr_epi8(0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0,
+                0, ':', 0));
+        _mm_storeu_si128((__m128i *)dest, out);
+
+        out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(lo,
+                _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1)), _mm_shuffle_epi8(hi,
+                _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3,
+                -1, 4, 5))),
+                _mm_setr_epi8(0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0,
+                ':', 0, 0));
+        _mm_storeu_si128((__m128i *)(dest + 16), out);
+
+        out = _mm_or_si128(_mm_shuffle_epi8(hi, _mm_setr_epi8(-1, 6, 7, -1,
+                8, 9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1)),
+                _mm_setr_epi8(':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':',
+                0, 0, ':'));
+        _mm_storeu_si128((__m128i *)(dest + 32), out);
+
+        dest += 48;
+    }
+
+    return i;
+}
+
+/*
+ * Convert sixteen hex digits into nibbles, setting valid to all ones
+ * where the digit was valid.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_nibbles(__m128i in, __m128i *valid)
+{
+    __m128i digit, letter, folded;
+
+    digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+    folded = _mm_or_si128(in, _mm_set1_epi8(0x20));
+    letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(folded, _mm_set1_epi8('f' + 1)));
+
+    *valid = _mm_or_si128(digit, letter);
+
+    return _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(in, _mm_set1_epi8('0'))),
+            _mm_and_si128(letter, _mm_sub_epi8(folded,
+            _mm_set1_epi8('a' - 10))));
+}
+
+/*
+ * Decode thirty two hex digits held in a and b into sixteen bytes,
+ * returning zero if any digit was invalid.
+ */
+__attribute__((target("sse4.1")))
+static inline int decode_sse41_pairs(__m128i a, __m128i b, __m128i *out)
+{
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i va, vb;
+
+    a = decode_sse41_nibbles(a, &va);
+    b = decode_sse41_nibbles(b, &vb);
+
+    if (_mm_movemask_epi8(_mm_and_si128(va, vb)) != 0xffff) {
+        return 0;
+    }
+
+    *out = _mm_packus_epi16(_mm_maddubs_epi16(a, weights),
+            _mm_maddubs_epi16(b, weights));
+
+    return 1;
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t decode_sse41(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 32; i += 32) {
+        __m128i out;
+
+        if (!decode_sse41_pairs(
+                _mm_loadu_si128((const __m128i *)(src + i)),
+                _mm_loadu_si128((const __m128i *)(src + i + 16)), &out)) {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)dest, out);
+        dest += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t decode_colon_sse41(unsigned char *dest,
+        const unsigned char *src, apr_size_t slen)
+{
+    const __m128i colon = _mm_set1_epi8(':');
+    apr_size_t i;
+
+    /* gather sixteen pairs out of forty eight characters, "XX:" each */
+    for (i = 0; slen - i >= 50; i += 48) {
+        __m128i in0, in1, in2, a, b, out;
+
+        in0 = _mm_loadu_si128((const __m128i *)(src + i));
+        in1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        in2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(in0, colon)) & 0x4924) != 0x4924
+                || (_mm_movemask_epi8(_mm_cmpeq_epi8(in1, colon)) & 0x2492)
+                != 0x2492
+                || (_mm_movemask_epi8(_mm_cmpeq_epi8(in2, colon)) & 0x9249)
+                != 0x9249) {
+            break;
+        }
+
+        a = _mm_or_si128(_mm_shuffle_epi8(in0, _mm_setr_epi8(0, 1, 3, 4, 6,
+                7, 9, 10, 12, 13, 15, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(in1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1,
+                -1, -1, -1, -1, -1, 0, 2, 3, 5, 6)));
+        b = _mm_or_si128(_mm_shuffle_epi8(in1, _mm_setr_epi8(8, 9, 11, 12,
+                14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                _mm_shuffle_epi8(in2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1,
+                1, 2, 4, 5, 7, 8, 10, 11, 13, 14)));
+
+        if (!decode_sse41_pairs(a, b, &out)) {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)dest, out);
+        dest += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t encode_avx2(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    const __m256i lookup = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)alphabet));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 32; i += 32) {
+        __m256i in, high, low;
+
+        /* order the quadwords so the per lane unpack comes out in order */
+        in = _mm256_permute4x64_epi64(
+                _mm256_loadu_si256((const __m256i *)(src + i)), 0xd8);
+
+        high = _mm256_shuffle_epi8(lookup,
+                _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+        low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(in, mask));
+
+        _mm256_storeu_si256((__m256i *)dest,
+                _mm256_unpacklo_epi8(high, low));
+        _mm256_storeu_si256((__m256i *)(dest + 32),
+                _mm256_unpackhi_epi8(high, low));
+        dest += 64;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i decode_avx2_nibbles(__m256i in, __m256i *valid)
+{
+    __m256i digit, letter, folded;
+
+    digit = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+    folded = _mm256_or_si256(in, _mm256_set1_epi8(0x20));
+    letter = _mm256_and_si256(
+            _mm256_cmpgt_epi8(folded, _mm256_set1_epi8('a' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), folded));
+
+    *valid = _mm256_or_si256(digit, letter);
+
+    return _mm256_or_si256(
+            _mm256_and_si256(digit, _mm256_sub_epi8(in, _mm256_set1_epi8('0'))),
+            _mm256_and_si256(letter, _mm256_sub_epi8(folded,
+            _mm256_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("avx2")))
+static apr_size_t decode_avx2(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 64; i += 64) {
+        __m256i a, b, va, vb;
+
+        a = decode_avx2_nibbles(
+                _mm256_loadu_si256((const __m256i *)(src + i)), &va);
+        b = decode_avx2_nibbles(
+                _mm256_loadu_si256((const __m256i *)(src + i + 32)), &vb);
+
+        if (_mm256_movemask_epi8(_mm256_and_si256(va, vb)) != -1) {
+            break;
+        }
+
+        /* the pack works per lane, put the quadwords back in order */
+        a = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights),
+                _mm256_maddubs_epi16(b, weights));
+        _mm256_storeu_si256((__m256i *)dest,
+                _mm256_permute4x64_epi64(a, 0xd8));
+        dest += 32;
+    }
+
+    return i;
+}
+
+#endif
+
+static encode_fn encode_bulk = encode_none;
+static encode_fn encode_colon_bulk = encode_none;
+static decode_fn decode_bulk = decode_none;
+static decode_fn decode_colon_bulk = decode_none;
+
+void endec_base16_init(int cpu)
+{
+    encode_bulk = encode_none;
+    encode_colon_bulk = encode_none;
+    decode_bulk = decode_none;
+    decode_colon_bulk = decode_none;
+
+#if ENDEC_X86
+    /* the colon layout does not suit wider lanes, stay with SSE4.1 */
+    if (cpu & (ENDEC_CPU_SSE41 | ENDEC_CPU_AVX2 | ENDEC_CPU_AVX512)) {
+        encode_bulk = encode_sse41;
+        encode_colon_bulk = encode_colon_sse41;
+        decode_bulk = decode_sse41;
+        decode_colon_bulk = decode_colon_sse41;
+    }
+    if (cpu & (ENDEC_CPU_AVX2 | ENDEC_CPU_AVX512)) {
+        encode_bulk = encode_avx2;
+        decode_bulk = decode_avx2;
+    }
+#endif
+}
+
+apr_status_t endec_encode_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const char *alphabet = (flags & APR_ENCODE_LOWER) ? base16lower : base16;
+    char *out = dest;
+    apr_size_t i;
+
+    if (flags & APR_ENCODE_COLON) {
+        i = encode_colon_bulk(out, in, slen, alphabet);
+        out += i * 3;
+        for (; i < slen; i++) {
+            *out++ = alphabet[in[i] >> 4];
+            *out++ = alphabet[in[i] & 0x0f];
+            if (i + 1 < slen) {
+                *out++ = ':';
+            }
+        }
+    }
+    else {
+        i = encode_bulk(out, in, slen, alphabet);
+        out += i * 2;
+        for (; i < slen; i++) {
+            *out++ = alphabet[in[i] >> 4];
+            *out++ = alphabet[in[i] & 0x0f];
+        }
+    }
+
+    *len = out - dest;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_decode_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dest;
+    apr_size_t i;
+    int hi, lo;
+
+    /* colon separated data is recognised by the first separator */
+    if ((flags & ENDEC_BASE16_COLON) || (!(flags & ENDEC_BASE16_PLAIN)
+            && slen > 2 && in[2] == ':')) {
+        i = decode_colon_bulk(out, in, slen);
+        out += i / 3;
+        while (i < slen) {
+            if (slen - i < 2) {
+                return APR_BADCH;
+            }
+            hi = hexval(in[i]);
+            lo = hexval(in[i + 1]);
+            if (hi < 0 || lo < 0) {
+                return APR_BADCH;
+            }
+            *out++ = (hi << 4) | lo;
+            i += 2;
+            /* a separator must be followed by another pair */
+            if (i < slen && (in[i++] != ':' || i == slen)) {
+                return APR_BADCH;
+            }
+        }
+    }
+    else {
+        i = decode_bulk(out, in, slen);
+        out += i / 2;
+        for (; i < slen; i += 2) {
+            if (slen - i < 2) {
+                return APR_BADCH;
+            }
+            hi = hexval(in[i]);
+            lo = hexval(in[i + 1]);
+            if (hi < 0 || lo < 0) {
+                return APR_BADCH;
+            }
+            *out++ = (hi << 4) | lo;
+        }
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
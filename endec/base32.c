@@ -0,0 +1,452 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - base32 and base32hex kernels
+ *
+ * The vector kernels handle the bulk of the data in whole blocks, and
+ * the scalar code handles what is left, including padding and errors.
+ */
+
+#include <apr.h>
+#include <apr_encode.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+static const char base32[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+static const char base32hex[] = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+
+/*
+ * Encode whole five byte blocks, returning the number of bytes consumed.
+ */
+typedef apr_size_t (*encode_fn)(char *dest, const unsigned char *src,
+        apr_size_t slen, int hex);
+
+/*
+ * Decode whole eight character blocks, stopping short of any block that
+ * holds an invalid character. Returns the number of characters consumed.
+ */
+typedef apr_size_t (*decode_fn)(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int hex);
+
+/* returns 32 for an invalid character */
+static unsigned int value(unsigned char c, int hex)
+{
+    if (hex) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if (c >= 'A' && c <= 'V') {
+            return c - 'A' + 10;
+        }
+    }
+    else {
+        if (c >= 'A' && c <= 'Z') {
+            return c - 'A';
+        }
+        if (c >= '2' && c <= '7') {
+            return c - '2' + 26;
+        }
+    }
+    return 32;
+}
+
+static apr_size_t encode_scalar(char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    const char *alphabet = hex ? base32hex : base32;
+    apr_size_t i;
+    int k;
+
+    for (i = 0; slen - i >= 5; i += 5) {
+        apr_uint64_t v = ((apr_uint64_t)src[i] << 32)
+                | ((apr_uint64_t)src[i + 1] << 24)
+                | ((apr_uint64_t)src[i + 2] << 16)
+                | ((apr_uint64_t)src[i + 3] << 8) | src[i + 4];
+
+        for (k = 35; k >= 0; k -= 5) {
+            *dest++ = alphabet[(v >> k) & 0x1f];
+        }
+    }
+
+    return i;
+}
+
+static apr_size_t decode_scalar(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    apr_size_t i;
+    int k;
+
+    for (i = 0; slen - i >= 8; i += 8) {
+        apr_uint64_t v = 0;
+        unsigned int bad = 0;
+
+        for (k = 0; k < 8; k++) {
+            unsigned int c = value(src[i + k], hex);
+            bad |= c;
+            v = (v << 5) | (c & 0x1f);
+        }
+        if (bad & 32) {
+            break;
+        }
+
+        for (k = 32; k >= 0; k -= 8) {
+            *dest++ = v >> k;
+        }
+    }
+
+    return i;
+}
+
+#if ENDEC_X86
+
+/*
+ * Each output character takes its five bits from a big endian pair of
+ * input bytes, shifted into place by a multiply.
+ */
+#define ENCODE_PAIRS(o) \
+        o + 1, o, o + 1, o, o + 2, o + 1, o + 2, o + 1, \
+        o + 3, o + 2, o + 4, o + 3, o + 4, o + 3, -1, o + 4
+#define ENCODE_SHIFTS \
+        1 << 5, 1 << 10, 1 << 7, 1 << 12, 1 << 9, 1 << 6, 1 << 11, 1 << 8
+
+__attribute__((target("sse4.1")))
+static inline __m128i encode_sse41_ascii(__m128i idx, int hex)
+{
+    /* two ranges per alphabet, split at 26 or at 10 */
+    __m128i low = _mm_cmpgt_epi8(_mm_set1_epi8(hex ? 10 : 26), idx);
+
+    return _mm_add_epi8(idx, _mm_blendv_epi8(
+            _mm_set1_epi8(hex ? 'A' - 10 : '2' - 26),
+            _mm_set1_epi8(hex ? '0' : 'A'), low));
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t encode_sse41(char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    const __m128i shifts = _mm_setr_epi16(ENCODE_SHIFTS);
+    const __m128i mask = _mm_set1_epi16(0x1f);
+    apr_size_t i;
+
+    /* each block reads sixteen bytes and uses ten */
+    for (i = 0; slen - i >= 16; i += 10) {
+        __m128i in, a, b;
+
+        in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        a = _mm_shuffle_epi8(in, _mm_setr_epi8(ENCODE_PAIRS(0)));
+        b = _mm_shuffle_epi8(in, _mm_setr_epi8(ENCODE_PAIRS(5)));
+        a = _mm_and_si128(_mm_mulhi_epu16(a, shifts), mask);
+        b = _mm_and_si128(_mm_mulhi_epu16(b, shifts), mask);
+
+        _mm_storeu_si128((__m128i *)dest,
+                encode_sse41_ascii(_mm_packus_epi16(a, b), hex));
+        dest += 16;
+    }
+
+    return i;
+}
+
+/*
+ * Convert sixteen characters to five bit values, setting valid to all
+ * ones where the character was valid.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_values(__m128i in, int hex,
+        __m128i *valid)
+{
+    __m128i upper, digit;
+
+    if (hex) {
+        digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+        upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                _mm_cmplt_epi8(in, _mm_set1_epi8('V' + 1)));
+        in = _mm_sub_epi8(in, _mm_blendv_epi8(_mm_set1_epi8('A' - 10),
+                _mm_set1_epi8('0'), digit));
+    }
+    else {
+        digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('2' - 1)),
+                _mm_cmplt_epi8(in, _mm_set1_epi8('7' + 1)));
+        upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+        in = _mm_sub_epi8(in, _mm_blendv_epi8(_mm_set1_epi8('A'),
+                _mm_set1_epi8('2' - 26), digit));
+    }
+
+    *valid = _mm_or_si128(upper, digit);
+
+    return in;
+}
+
+/*
+ * Pack each eight five bit values into a forty bit value held in the
+ * low bits of a quadword.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_pack(__m128i in)
+{
+    in = _mm_maddubs_epi16(in, _mm_set1_epi16(0x0120));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00010400));
+
+    return _mm_or_si128(_mm_srli_epi64(in, 32), _mm_slli_epi64(
+            _mm_and_si128(in, _mm_set1_epi64x(0xffffffff)), 20));
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t decode_sse41(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    apr_size_t i;
+
+    /* each block writes sixteen bytes and uses ten */
+    for (i = 0; slen - i >= 16; i += 16) {
+        __m128i in, valid;
+
+        in = decode_sse41_values(
+                _mm_loadu_si128((const __m128i *)(src + i)), hex, &valid);
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+
+        in = _mm_shuffle_epi8(decode_sse41_pack(in), _mm_setr_epi8(4, 3,
+                2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+
+        _mm_storeu_si128((__m128i *)dest, in);
+        dest += 10;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i encode_avx2_ascii(__m256i idx, int hex)
+{
+    __m256i low = _mm256_cmpgt_epi8(_mm256_set1_epi8(hex ? 10 : 26), idx);
+
+    return _mm256_add_epi8(idx, _mm256_blendv_epi8(
+            _mm256_set1_epi8(hex ? 'A' - 10 : '2' - 26),
+            _mm256_set1_epi8(hex ? '0' : 'A'), low));
+}
+
+__attribute__((target("avx2")))
+static apr_size_t encode_avx2(char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    const __m256i pairs_a = _mm256_setr_epi8(ENCODE_PAIRS(0),
+            ENCODE_PAIRS(0));
+    const __m256i pairs_b = _mm256_setr_epi8(ENCODE_PAIRS(5),
+            ENCODE_PAIRS(5));
+    const __m256i shifts = _mm256_setr_epi16(ENCODE_SHIFTS, ENCODE_SHIFTS);
+    const __m256i mask = _mm256_set1_epi16(0x1f);
+    apr_size_t i;
+
+    /* each lane takes ten bytes, the upper load reads up to byte 26 */
+    for (i = 0; slen - i >= 26; i += 20) {
+        __m256i in, a, b;
+
+        in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(src + i))),
+                _mm_loadu_si128((const __m128i *)(src + i + 10)), 1);
+
+        a = _mm256_shuffle_epi8(in, pairs_a);
+        b = _mm256_shuffle_epi8(in, pairs_b);
+        a = _mm256_and_si256(_mm256_mulhi_epu16(a, shifts), mask);
+        b = _mm256_and_si256(_mm256_mulhi_epu16(b, shifts), mask);
+
+        _mm256_storeu_si256((__m256i *)dest,
+                encode_avx2_ascii(_mm256_packus_epi16(a, b), hex));
+        dest += 32;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t decode_avx2(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int hex)
+{
+    const __m256i pack = _mm256_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8,
+            -1, -1, -1, -1, -1, -1, 4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1,
+            -1, -1, -1, -1);
+    apr_size_t i;
+
+    /* each block writes twenty six bytes and uses twenty */
+    for (i = 0; slen - i >= 32; i += 32) {
+        __m256i in, upper, digit, valid;
+
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        if (hex) {
+            digit = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+            upper = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('V' + 1), in));
+            in = _mm256_sub_epi8(in, _mm256_blendv_epi8(
+                    _mm256_set1_epi8('A' - 10), _mm256_set1_epi8('0'),
+                    digit));
+        }
+        else {
+            digit = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('2' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('7' + 1), in));
+            upper = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+            in = _mm256_sub_epi8(in, _mm256_blendv_epi8(
+                    _mm256_set1_epi8('A'), _mm256_set1_epi8('2' - 26),
+                    digit));
+        }
+
+        valid = _mm256_or_si256(upper, digit);
+        if (_mm256_movemask_epi8(valid) != -1) {
+            break;
+        }
+
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi16(0x0120));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00010400));
+        in = _mm256_or_si256(_mm256_srli_epi64(in, 32), _mm256_slli_epi64(
+                _mm256_and_si256(in, _mm256_set1_epi64x(0xffffffff)), 20));
+        in = _mm256_shuffle_epi8(in, pack);
+
+        _mm_storeu_si128((__m128i *)dest, _mm256_castsi256_si128(in));
+        _mm_storeu_si128((__m128i *)(dest + 10),
+                _mm256_extracti128_si256(in, 1));
+        dest += 20;
+    }
+
+    return i;
+}
+
+#endif
+
+static encode_fn encode_bulk = encode_scalar;
+static decode_fn decode_bulk = decode_scalar;
+
+void endec_base32_init(int cpu)
+{
+    encode_bulk = encode_scalar;
+    decode_bulk = decode_scalar;
+
+#if ENDEC_X86
+    /* five byte blocks gain nothing from the wider AVX-512 permutes */
+    if (cpu & (ENDEC_CPU_AVX2 | ENDEC_CPU_AVX512)) {
+        encode_bulk = encode_avx2;
+        decode_bulk = decode_avx2;
+    }
+    else if (cpu & ENDEC_CPU_SSE41) {
+        encode_bulk = encode_sse41;
+        decode_bulk = decode_sse41;
+    }
+#endif
+}
+
+apr_status_t endec_encode_base32(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    int hex = (flags & APR_ENCODE_BASE32HEX) != 0;
+    const char *alphabet = hex ? base32hex : base32;
+    char *out = dest;
+    apr_uint64_t v = 0;
+    apr_size_t i, rest, k, n;
+
+    i = encode_bulk(out, in, slen, hex);
+    i += encode_scalar(out + i / 5 * 8, in + i, slen - i, hex);
+    out += i / 5 * 8;
+
+    rest = slen - i;
+    if (rest) {
+        for (k = 0; k < 5; k++) {
+            v = (v << 8) | (k < rest ? in[i + k] : 0);
+        }
+
+        /* characters needed to cover the remaining bits */
+        n = (rest * 8 + 4) / 5;
+        for (k = 0; k < n; k++) {
+            *out++ = alphabet[(v >> (35 - 5 * k)) & 0x1f];
+        }
+        if (!(flags & APR_ENCODE_NOPADDING)) {
+            for (; k < 8; k++) {
+                *out++ = '=';
+            }
+        }
+    }
+
+    *len = out - dest;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_decode_base32(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dest;
+    int hex = (flags & APR_ENCODE_BASE32HEX) != 0;
+    apr_uint64_t v = 0;
+    apr_size_t i, rest, k;
+    unsigned int c;
+
+    /* padding may only appear at the end */
+    while (slen && in[slen - 1] == '=') {
+        slen--;
+    }
+
+    i = decode_bulk(out, in, slen, hex);
+    i += decode_scalar(out + i / 8 * 5, in + i, slen - i, hex);
+    out += i / 8 * 5;
+
+    rest = slen - i;
+    switch (rest) {
+    case 0:
+    case 2:
+    case 4:
+    case 5:
+    case 7:
+        break;
+    default:
+        /* an impossible length, or an invalid block */
+        return APR_BADCH;
+    }
+
+    for (k = 0; k < 8; k++) {
+        c = k < rest ? value(in[i + k], hex) : 0;
+        if (c & 32) {
+            return APR_BADCH;
+        }
+        v = (v << 5) | c;
+    }
+
+    /* whole bytes covered by the remaining characters */
+    for (k = 0; k < rest * 5 / 8; k++) {
+        *out++ = v >> (32 - 8 * k);
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
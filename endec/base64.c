@@ -0,0 +1,518 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - base64 and base64url kernels
+ *
+ * The vector kernels handle the bulk of the data in whole blocks, and
+ * the scalar code handles what is left, including padding and errors.
+ */
+
+#include <apr.h>
+#include <apr_encode.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64url[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* both alphabets decode, 128 marks an invalid character */
+static const unsigned char pr2six[256] =
+{
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,  62, 128,  62, 128,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 128, 128, 128, 128, 128, 128,
+    128,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 128, 128, 128, 128,  63,
+    128,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128,
+};
+
+/*
+ * Encode whole three byte blocks, returning the number of bytes consumed.
+ */
+typedef apr_size_t (*encode_fn)(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet);
+
+/*
+ * Decode whole four character blocks, stopping short of any block that
+ * holds an invalid character. Returns the number of characters consumed.
+ */
+typedef apr_size_t (*decode_fn)(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen);
+
+static apr_size_t encode_scalar(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 3; i += 3) {
+        *dest++ = alphabet[src[i] >> 2];
+        *dest++ = alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        *dest++ = alphabet[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+        *dest++ = alphabet[src[i + 2] & 0x3f];
+    }
+
+    return i;
+}
+
+static apr_size_t decode_scalar(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 4; i += 4) {
+        unsigned int a = pr2six[src[i]];
+        unsigned int b = pr2six[src[i + 1]];
+        unsigned int c = pr2six[src[i + 2]];
+        unsigned int d = pr2six[src[i + 3]];
+
+        if ((a | b | c | d) & 0x80) {
+            break;
+        }
+
+        *dest++ = (a << 2) | (b >> 4);
+        *dest++ = (b << 4) | (c >> 2);
+        *dest++ = (c << 6) | d;
+    }
+
+    return i;
+}
+
+#if ENDEC_X86
+
+/*
+ * The vector kernels follow the approach described by Wojciech Muła and
+ * Daniel Lemire in "Faster Base64 Encoding and Decoding Using AVX2
+ * Instructions".
+ */
+
+__attribute__((target("sse4.1")))
+static inline __m128i encode_sse41_block(__m128i in, __m128i shift)
+{
+    __m128i hi, lo, idx, offset;
+
+    /* split each three bytes into four six bit indices */
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6,
+            8, 7, 10, 9, 11, 10));
+    hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+            _mm_set1_epi32(0x04000040));
+    lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+            _mm_set1_epi32(0x01000010));
+    idx = _mm_or_si128(hi, lo);
+
+    /* map each range of indices to the offset of its ASCII range */
+    offset = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    offset = _mm_or_si128(offset, _mm_and_si128(_mm_cmpgt_epi8(
+            _mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, offset), idx);
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t encode_sse41(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, alphabet[62] - 62, alphabet[63] - 63, 'A',
+            0, 0);
+    apr_size_t i;
+
+    /* each block reads sixteen bytes and uses twelve */
+    for (i = 0; slen - i >= 16; i += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        _mm_storeu_si128((__m128i *)dest, encode_sse41_block(in, shift));
+        dest += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t encode_avx2(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6,
+            8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9,
+            11, 10);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, alphabet[62] - 62, alphabet[63] - 63, 'A',
+            0, 0, 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            alphabet[62] - 62, alphabet[63] - 63, 'A', 0, 0);
+    apr_size_t i;
+
+    /* each lane takes twelve bytes, the upper load reads up to byte 28 */
+    for (i = 0; slen - i >= 28; i += 24) {
+        __m256i in, hi, lo, idx, offset;
+
+        in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(src + i))),
+                _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+
+        in = _mm256_shuffle_epi8(in, shuffle);
+        hi = _mm256_mulhi_epu16(_mm256_and_si256(in,
+                _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        lo = _mm256_mullo_epi16(_mm256_and_si256(in,
+                _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        idx = _mm256_or_si256(hi, lo);
+
+        offset = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        offset = _mm256_or_si256(offset, _mm256_and_si256(_mm256_cmpgt_epi8(
+                _mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+
+        _mm256_storeu_si256((__m256i *)dest, _mm256_add_epi8(
+                _mm256_shuffle_epi8(shift, offset), idx));
+        dest += 32;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static apr_size_t encode_avx512(char *dest, const unsigned char *src,
+        apr_size_t slen, const char *alphabet)
+{
+    /* duplicate each block of three bytes into four, as b a c b */
+    const __m512i shuffle = _mm512_setr_epi32(0x01020001, 0x04050304,
+            0x07080607, 0x0a0b090a, 0x0d0e0c0d, 0x10110f10, 0x13141213,
+            0x16171516, 0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+            0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+    /* bit offsets of each six bit index within the duplicated blocks */
+    const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aULL);
+    const __m512i lookup = _mm512_loadu_si512((const void *)alphabet);
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 48; i += 48) {
+        __m512i in = _mm512_maskz_loadu_epi8(0x0000ffffffffffffULL, src + i);
+
+        in = _mm512_permutexvar_epi8(shuffle, in);
+        in = _mm512_multishift_epi64_epi8(shifts, in);
+
+        _mm512_storeu_si512((void *)dest, _mm512_permutexvar_epi8(in, lookup));
+        dest += 64;
+    }
+
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_range(__m128i in, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8(lo - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8(hi + 1)));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_char(__m128i in, char c, char offset,
+        __m128i *valid)
+{
+    __m128i match = _mm_cmpeq_epi8(in, _mm_set1_epi8(c));
+
+    *valid = _mm_or_si128(*valid, match);
+
+    return _mm_and_si128(match, _mm_set1_epi8(offset));
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t decode_sse41(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    apr_size_t i;
+
+    /* each block writes sixteen bytes and uses twelve */
+    for (i = 0; slen - i >= 16; i += 16) {
+        __m128i in, upper, lower, digit, valid, offset;
+
+        in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        /* find the offset from each character to its value */
+        upper = decode_sse41_range(in, 'A', 'Z');
+        lower = decode_sse41_range(in, 'a', 'z');
+        digit = decode_sse41_range(in, '0', '9');
+        valid = _mm_or_si128(_mm_or_si128(upper, lower), digit);
+
+        offset = _mm_or_si128(_mm_or_si128(
+                _mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+                _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+        offset = _mm_or_si128(offset, decode_sse41_char(in, '+', 62 - '+',
+                &valid));
+        offset = _mm_or_si128(offset, decode_sse41_char(in, '-', 62 - '-',
+                &valid));
+        offset = _mm_or_si128(offset, decode_sse41_char(in, '/', 63 - '/',
+                &valid));
+        offset = _mm_or_si128(offset, decode_sse41_char(in, '_', 63 - '_',
+                &valid));
+
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+
+        /* pack four six bit values into three bytes */
+        in = _mm_maddubs_epi16(_mm_add_epi8(in, offset),
+                _mm_set1_epi32(0x01400140));
+        in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+        in = _mm_shuffle_epi8(in, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1));
+
+        _mm_storeu_si128((__m128i *)dest, in);
+        dest += 12;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i decode_avx2_range(__m256i in, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8(lo - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), in));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i decode_avx2_char(__m256i in, char c, char offset,
+        __m256i *valid)
+{
+    __m256i match = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(c));
+
+    *valid = _mm256_or_si256(*valid, match);
+
+    return _mm256_and_si256(match, _mm256_set1_epi8(offset));
+}
+
+__attribute__((target("avx2")))
+static apr_size_t decode_avx2(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    apr_size_t i;
+
+    /* each block writes thirty two bytes and uses twenty four */
+    for (i = 0; slen - i >= 32; i += 32) {
+        __m256i in, upper, lower, digit, valid, offset;
+
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        upper = decode_avx2_range(in, 'A', 'Z');
+        lower = decode_avx2_range(in, 'a', 'z');
+        digit = decode_avx2_range(in, '0', '9');
+        valid = _mm256_or_si256(_mm256_or_si256(upper, lower), digit);
+
+        offset = _mm256_or_si256(_mm256_or_si256(
+                _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+                _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+        offset = _mm256_or_si256(offset, decode_avx2_char(in, '+', 62 - '+',
+                &valid));
+        offset = _mm256_or_si256(offset, decode_avx2_char(in, '-', 62 - '-',
+                &valid));
+        offset = _mm256_or_si256(offset, decode_avx2_char(in, '/', 63 - '/',
+                &valid));
+        offset = _mm256_or_si256(offset, decode_avx2_char(in, '_', 63 - '_',
+                &valid));
+
+        if (_mm256_movemask_epi8(valid) != -1) {
+            break;
+        }
+
+        in = _mm256_maddubs_epi16(_mm256_add_epi8(in, offset),
+                _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10,
+                9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+                14, 13, 12, -1, -1, -1, -1));
+        in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4, 5,
+                6, 3, 7));
+
+        _mm256_storeu_si256((__m256i *)dest, in);
+        dest += 24;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static apr_size_t decode_avx512(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen)
+{
+    /* the first half of the decode table covers all of ASCII */
+    const __m512i lookup_lo = _mm512_loadu_si512((const void *)pr2six);
+    const __m512i lookup_hi = _mm512_loadu_si512((const void *)(pr2six + 64));
+    /* gather the three bytes held in each 32 bit word */
+    const __m512i pack = _mm512_setr_epi32(0x06000102, 0x090a0405,
+            0x0c0d0e08, 0x16101112, 0x191a1415, 0x1c1d1e18, 0x26202122,
+            0x292a2425, 0x2c2d2e28, 0x36303132, 0x393a3435, 0x3c3d3e38, 0, 0,
+            0, 0);
+    apr_size_t i;
+
+    for (i = 0; slen - i >= 64; i += 64) {
+        __m512i in, values;
+
+        in = _mm512_loadu_si512((const void *)(src + i));
+        values = _mm512_permutex2var_epi8(lookup_lo, in, lookup_hi);
+
+        /* non ASCII input, or an invalid character */
+        if (_mm512_movepi8_mask(_mm512_or_si512(in, values))) {
+            break;
+        }
+
+        values = _mm512_maddubs_epi16(values, _mm512_set1_epi32(0x01400140));
+        values = _mm512_madd_epi16(values, _mm512_set1_epi32(0x00011000));
+        values = _mm512_permutexvar_epi8(pack, values);
+
+        _mm512_mask_storeu_epi8(dest, 0x0000ffffffffffffULL, values);
+        dest += 48;
+    }
+
+    return i;
+}
+
+#endif
+
+static encode_fn encode_bulk = encode_scalar;
+static decode_fn decode_bulk = decode_scalar;
+
+void endec_base64_init(int cpu)
+{
+    encode_bulk = encode_scalar;
+    decode_bulk = decode_scalar;
+
+#if ENDEC_X86
+    if (cpu & ENDEC_CPU_AVX512) {
+        encode_bulk = encode_avx512;
+        decode_bulk = decode_avx512;
+    }
+    else if (cpu & ENDEC_CPU_AVX2) {
+        encode_bulk = encode_avx2;
+        decode_bulk = decode_avx2;
+    }
+    else if (cpu & ENDEC_CPU_SSE41) {
+        encode_bulk = encode_sse41;
+        decode_bulk = decode_sse41;
+    }
+#endif
+}
+
+apr_status_t endec_encode_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const char *alphabet = (flags & APR_ENCODE_URL) ? base64url : base64;
+    char *out = dest;
+    apr_size_t i;
+
+    i = encode_bulk(out, in, slen, alphabet);
+    out += i / 3 * 4;
+
+    i += encode_scalar(out, in + i, slen - i, alphabet);
+    out = dest + i / 3 * 4;
+
+    switch (slen - i) {
+    case 1: {
+        *out++ = alphabet[in[i] >> 2];
+        *out++ = alphabet[(in[i] & 0x03) << 4];
+        if (!(flags & APR_ENCODE_NOPADDING)) {
+            *out++ = '=';
+            *out++ = '=';
+        }
+        break;
+    }
+    case 2: {
+        *out++ = alphabet[in[i] >> 2];
+        *out++ = alphabet[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+        *out++ = alphabet[(in[i + 1] & 0x0f) << 2];
+        if (!(flags & APR_ENCODE_NOPADDING)) {
+            *out++ = '=';
+        }
+        break;
+    }
+    }
+
+    *len = out - dest;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_decode_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dest;
+    unsigned int a, b, c;
+    apr_size_t i;
+
+    /* padding may only appear at the end */
+    while (slen && in[slen - 1] == '=') {
+        slen--;
+    }
+
+    i = decode_bulk(out, in, slen);
+    i += decode_scalar(out + i / 4 * 3, in + i, slen - i);
+    out += i / 4 * 3;
+
+    switch (slen - i) {
+    case 0: {
+        break;
+    }
+    case 2: {
+        a = pr2six[in[i]];
+        b = pr2six[in[i + 1]];
+        if ((a | b) & 0x80) {
+            return APR_BADCH;
+        }
+        *out++ = (a << 2) | (b >> 4);
+        break;
+    }
+    case 3: {
+        a = pr2six[in[i]];
+        b = pr2six[in[i + 1]];
+        c = pr2six[in[i + 2]];
+        if ((a | b | c) & 0x80) {
+            return APR_BADCH;
+        }
+        *out++ = (a << 2) | (b >> 4);
+        *out++ = (b << 4) | (c >> 2);
+        break;
+    }
+    default:
+        /* a lone character, or an invalid block */
+        return APR_BADCH;
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
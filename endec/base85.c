@@ -0,0 +1,743 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - base85, Z85 and Ascii85 kernels
+ *
+ * Each four byte block is written as five digits in base 85, most
+ * significant first. A final partial block of n bytes is written as the
+ * first n + 1 digits of the block padded with zeros, and is read back
+ * by padding the digits with the largest digit. Ascii85 writes a block
+ * of zeros as 'z'.
+ *
+ * The vector kernels handle the bulk of the data in whole blocks, and
+ * the scalar code handles what is left, including 'z' and errors.
+ */
+
+#include <string.h>
+
+#include <apr.h>
+#include <apr_encode.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+#define ALPHABET_BASE85 0
+#define ALPHABET_Z85 1
+#define ALPHABET_ASCII85 2
+
+/* marks a character that is not a digit */
+#define NOT_DIGIT 0xff
+
+/* the first four digits of the largest block, whose last digit is 0 */
+#define BLOCK_MAX_HIGH 50529027
+
+/* bytes or characters left to the scalar code between vector runs */
+#define SCALAR_RUN 40
+
+typedef struct alphabet_t {
+    /* the character for each digit, padded to six rows of sixteen */
+    char chars[96];
+    /* the digit for each character, or NOT_DIGIT */
+    unsigned char values[256];
+} alphabet_t;
+
+static alphabet_t alphabets[3];
+
+/*
+ * Encode whole four byte blocks, stopping short of any block of zeros
+ * when writing Ascii85. Returns the number of bytes consumed.
+ */
+typedef apr_size_t (*encode_fn)(char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha);
+
+/*
+ * Decode whole five character blocks, stopping short of any block that
+ * holds an invalid character or is too large. Returns the number of
+ * characters consumed.
+ */
+typedef apr_size_t (*decode_fn)(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha);
+
+static int alphabet(int flags)
+{
+    if (flags & ENDEC_BASE85_Z85) {
+        return ALPHABET_Z85;
+    }
+    if (flags & ENDEC_BASE85_ASCII85) {
+        return ALPHABET_ASCII85;
+    }
+    return ALPHABET_BASE85;
+}
+
+static void alphabet_make(alphabet_t *a, const char *chars)
+{
+    int i;
+
+    memset(a->values, NOT_DIGIT, sizeof(a->values));
+
+    for (i = 0; i < 85; i++) {
+        a->chars[i] = chars[i];
+        a->values[(unsigned char)chars[i]] = i;
+    }
+}
+
+/*
+ * Encode whole four byte blocks, returning the number of characters
+ * written.
+ */
+static apr_size_t encode_scalar(char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    const char *chars = alphabets[alpha].chars;
+    char *out = dest;
+    apr_size_t i;
+    int k;
+
+    for (i = 0; slen - i >= 4; i += 4) {
+        apr_uint32_t v = ((apr_uint32_t)src[i] << 24)
+                | ((apr_uint32_t)src[i + 1] << 16)
+                | ((apr_uint32_t)src[i + 2] << 8) | src[i + 3];
+
+        if (!v && alpha == ALPHABET_ASCII85) {
+            *out++ = 'z';
+            continue;
+        }
+
+        for (k = 4; k >= 0; k--) {
+            out[k] = chars[v % 85];
+            v /= 85;
+        }
+        out += 5;
+    }
+
+    return out - dest;
+}
+
+/*
+ * Decode whole blocks, stopping short of any block that holds an
+ * invalid character or is too large, or that is cut short. Returns the
+ * number of characters consumed, and the number of bytes written in len.
+ */
+static apr_size_t decode_scalar(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha, apr_size_t *len)
+{
+    const unsigned char *values = alphabets[alpha].values;
+    unsigned char *out = dest;
+    apr_size_t i = 0;
+    int k;
+
+    while (i < slen) {
+        apr_uint64_t v = 0;
+        unsigned int bad = 0;
+
+        if (src[i] == 'z' && alpha == ALPHABET_ASCII85) {
+            memset(out, 0, 4);
+            out += 4;
+            i++;
+            continue;
+        }
+
+        if (slen - i < 5) {
+            break;
+        }
+
+        for (k = 0; k < 5; k++) {
+            unsigned int c = values[src[i + k]];
+            bad |= c;
+            v = v * 85 + (c & 0x7f);
+        }
+        if ((bad & 0x80) || v > 0xffffffff) {
+            break;
+        }
+
+        for (k = 24; k >= 0; k -= 8) {
+            *out++ = v >> k;
+        }
+        i += 5;
+    }
+
+    *len = out - dest;
+
+    return i;
+}
+
+#if ENDEC_X86
+
+/*
+ * Each four characters of a block come from one word of digits, and the
+ * fifth from the low byte of a word of last digits.
+ */
+#define BSWAP32 \
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define ENCODE_HEAD \
+        0, 1, 2, 3, -1, 4, 5, 6, 7, -1, 8, 9, 10, 11, -1, 12
+#define ENCODE_HEAD_LAST \
+        -1, -1, -1, -1, 0, -1, -1, -1, -1, 4, -1, -1, -1, -1, 8, -1
+#define ENCODE_TAIL \
+        13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+#define ENCODE_TAIL_LAST \
+        -1, -1, -1, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+
+/*
+ * Four blocks are read as twenty characters loaded at offsets zero and
+ * four. The first four digits of each block are gathered into a word,
+ * and the fifth into a word of its own.
+ */
+#define DECODE_HEAD \
+        0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, -1, -1, -1, -1
+#define DECODE_HEAD_LAST \
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 11, 12, 13, 14
+#define DECODE_LAST \
+        0, -1, -1, -1, 5, -1, -1, -1, 10, -1, -1, -1, 15, -1, -1, -1
+
+/* store the low four bytes */
+__attribute__((target("sse4.1")))
+static inline void store4_sse41(char *dest, __m128i v)
+{
+    int w = _mm_cvtsi128_si32(v);
+
+    memcpy(dest, &w, 4);
+}
+
+/*
+ * Divide each word by 85, with a multiply by the reciprocal that is
+ * exact for every 32 bit value.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i div85_sse41(__m128i v)
+{
+    const __m128i m = _mm_set1_epi32(0xc0c0c0c1);
+    __m128i even, odd;
+
+    even = _mm_srli_epi64(_mm_mul_epu32(v, m), 38);
+    odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), m), 38);
+
+    return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+/* multiply each word by 85 as 64 + 16 + 4 + 1 */
+__attribute__((target("sse4.1")))
+static inline __m128i mul85_sse41(__m128i v)
+{
+    return _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(v, 6),
+            _mm_slli_epi32(v, 4)), _mm_add_epi32(_mm_slli_epi32(v, 2), v));
+}
+
+/*
+ * Look up sixteen digits as characters, a row of the alphabet at a time.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i chars_sse41(__m128i d, int alpha)
+{
+    const char *chars = alphabets[alpha].chars;
+    __m128i hi, lo, r;
+    int k;
+
+    if (alpha == ALPHABET_ASCII85) {
+        return _mm_add_epi8(d, _mm_set1_epi8('!'));
+    }
+
+    hi = _mm_and_si128(_mm_srli_epi16(d, 4), _mm_set1_epi8(0x0f));
+    lo = _mm_and_si128(d, _mm_set1_epi8(0x0f));
+    r = _mm_setzero_si128();
+
+    for (k = 0; k < 6; k++) {
+        r = _mm_blendv_epi8(r, _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(chars + k * 16)), lo),
+                _mm_cmpeq_epi8(hi, _mm_set1_epi8(k)));
+    }
+
+    return r;
+}
+
+/*
+ * Look up sixteen characters as digits, a row of the printable
+ * characters at a time, setting valid to all ones where the character
+ * was a digit.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i values_sse41(__m128i in, int alpha, __m128i *valid)
+{
+    const unsigned char *values = alphabets[alpha].values;
+    __m128i hi, lo, r;
+    int k;
+
+    if (alpha == ALPHABET_ASCII85) {
+        r = _mm_sub_epi8(in, _mm_set1_epi8('!'));
+        *valid = _mm_cmpeq_epi8(_mm_min_epu8(r, _mm_set1_epi8(84)), r);
+        return r;
+    }
+
+    hi = _mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(0x0f));
+    lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    r = _mm_set1_epi8((char)NOT_DIGIT);
+
+    for (k = 2; k < 8; k++) {
+        r = _mm_blendv_epi8(r, _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(values + k * 16)), lo),
+                _mm_cmpeq_epi8(hi, _mm_set1_epi8(k)));
+    }
+
+    *valid = _mm_cmpeq_epi8(_mm_min_epu8(r, _mm_set1_epi8(84)), r);
+
+    return r;
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t encode_sse41(char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    const __m128i bswap = _mm_setr_epi8(BSWAP32);
+    apr_size_t i;
+
+    /* each block reads sixteen bytes and writes twenty characters */
+    for (i = 0; slen - i >= 16; i += 16) {
+        __m128i v, q, d, last, head;
+
+        v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i)),
+                bswap);
+        if (alpha == ALPHABET_ASCII85 && _mm_movemask_epi8(
+                _mm_cmpeq_epi32(v, _mm_setzero_si128()))) {
+            break;
+        }
+
+        q = div85_sse41(v);
+        last = _mm_sub_epi32(v, mul85_sse41(q));
+        v = div85_sse41(q);
+        d = _mm_slli_epi32(_mm_sub_epi32(q, mul85_sse41(v)), 24);
+        q = div85_sse41(v);
+        d = _mm_or_si128(d, _mm_slli_epi32(_mm_sub_epi32(v,
+                mul85_sse41(q)), 16));
+        v = div85_sse41(q);
+        d = _mm_or_si128(d, _mm_slli_epi32(_mm_sub_epi32(q,
+                mul85_sse41(v)), 8));
+        d = _mm_or_si128(d, v);
+
+        d = chars_sse41(d, alpha);
+        last = chars_sse41(last, alpha);
+
+        head = _mm_or_si128(_mm_shuffle_epi8(d, _mm_setr_epi8(ENCODE_HEAD)),
+                _mm_shuffle_epi8(last, _mm_setr_epi8(ENCODE_HEAD_LAST)));
+        _mm_storeu_si128((__m128i *)dest, head);
+        store4_sse41(dest + 16, _mm_or_si128(
+                _mm_shuffle_epi8(d, _mm_setr_epi8(ENCODE_TAIL)),
+                _mm_shuffle_epi8(last, _mm_setr_epi8(ENCODE_TAIL_LAST))));
+        dest += 20;
+    }
+
+    return i;
+}
+
+/*
+ * Combine the gathered digits of four blocks into words, setting over
+ * to all ones where a block is too large.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i decode_sse41_words(__m128i head, __m128i last,
+        __m128i *over)
+{
+    const __m128i high = _mm_set1_epi32(BLOCK_MAX_HIGH);
+    __m128i t;
+
+    /* d0 * 85^3 + d1 * 85^2 + d2 * 85 + d3 */
+    t = _mm_maddubs_epi16(head, _mm_set1_epi16(0x0155));
+    t = _mm_madd_epi16(t, _mm_set1_epi32(0x00011c39));
+
+    *over = _mm_or_si128(_mm_cmpgt_epi32(t, high), _mm_and_si128(
+            _mm_cmpeq_epi32(t, high),
+            _mm_cmpgt_epi32(last, _mm_setzero_si128())));
+
+    return _mm_add_epi32(mul85_sse41(t), last);
+}
+
+__attribute__((target("sse4.1")))
+static apr_size_t decode_sse41(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    apr_size_t i;
+
+    /* each block reads twenty characters and writes sixteen bytes */
+    for (i = 0; slen - i >= 20; i += 20) {
+        __m128i a, b, va, vb, head, last, over;
+
+        a = values_sse41(_mm_loadu_si128((const __m128i *)(src + i)), alpha,
+                &va);
+        b = values_sse41(_mm_loadu_si128((const __m128i *)(src + i + 4)),
+                alpha, &vb);
+        if (_mm_movemask_epi8(_mm_and_si128(va, vb)) != 0xffff) {
+            break;
+        }
+
+        head = _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(DECODE_HEAD)),
+                _mm_shuffle_epi8(b, _mm_setr_epi8(DECODE_HEAD_LAST)));
+        last = _mm_shuffle_epi8(b, _mm_setr_epi8(DECODE_LAST));
+
+        a = decode_sse41_words(head, last, &over);
+        if (_mm_movemask_epi8(over)) {
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *)dest,
+                _mm_shuffle_epi8(a, _mm_setr_epi8(BSWAP32)));
+        dest += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div85_avx2(__m256i v)
+{
+    const __m256i m = _mm256_set1_epi32(0xc0c0c0c1);
+    __m256i even, odd;
+
+    even = _mm256_srli_epi64(_mm256_mul_epu32(v, m), 38);
+    odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), m),
+            38);
+
+    return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mul85_avx2(__m256i v)
+{
+    return _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(v, 6),
+            _mm256_slli_epi32(v, 4)),
+            _mm256_add_epi32(_mm256_slli_epi32(v, 2), v));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i row_avx2(const void *row)
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)row));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i chars_avx2(__m256i d, int alpha)
+{
+    const char *chars = alphabets[alpha].chars;
+    __m256i hi, lo, r;
+    int k;
+
+    if (alpha == ALPHABET_ASCII85) {
+        return _mm256_add_epi8(d, _mm256_set1_epi8('!'));
+    }
+
+    hi = _mm256_and_si256(_mm256_srli_epi16(d, 4), _mm256_set1_epi8(0x0f));
+    lo = _mm256_and_si256(d, _mm256_set1_epi8(0x0f));
+    r = _mm256_setzero_si256();
+
+    for (k = 0; k < 6; k++) {
+        r = _mm256_blendv_epi8(r, _mm256_shuffle_epi8(
+                row_avx2(chars + k * 16), lo),
+                _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k)));
+    }
+
+    return r;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i values_avx2(__m256i in, int alpha, __m256i *valid)
+{
+    const unsigned char *values = alphabets[alpha].values;
+    __m256i hi, lo, r;
+    int k;
+
+    if (alpha == ALPHABET_ASCII85) {
+        r = _mm256_sub_epi8(in, _mm256_set1_epi8('!'));
+        *valid = _mm256_cmpeq_epi8(_mm256_min_epu8(r,
+                _mm256_set1_epi8(84)), r);
+        return r;
+    }
+
+    hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), _mm256_set1_epi8(0x0f));
+    lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+    r = _mm256_set1_epi8((char)NOT_DIGIT);
+
+    for (k = 2; k < 8; k++) {
+        r = _mm256_blendv_epi8(r, _mm256_shuffle_epi8(
+                row_avx2(values + k * 16), lo),
+                _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(k)));
+    }
+
+    *valid = _mm256_cmpeq_epi8(_mm256_min_epu8(r, _mm256_set1_epi8(84)), r);
+
+    return r;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t encode_avx2(char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    const __m256i bswap = _mm256_setr_epi8(BSWAP32, BSWAP32);
+    const __m256i head_d = _mm256_setr_epi8(ENCODE_HEAD, ENCODE_HEAD);
+    const __m256i head_last = _mm256_setr_epi8(ENCODE_HEAD_LAST,
+            ENCODE_HEAD_LAST);
+    const __m256i tail_d = _mm256_setr_epi8(ENCODE_TAIL, ENCODE_TAIL);
+    const __m256i tail_last = _mm256_setr_epi8(ENCODE_TAIL_LAST,
+            ENCODE_TAIL_LAST);
+    apr_size_t i;
+
+    /* each lane takes four blocks, writing twenty characters */
+    for (i = 0; slen - i >= 32; i += 32) {
+        __m256i v, q, d, last, head, tail;
+
+        v = _mm256_shuffle_epi8(_mm256_loadu_si256(
+                (const __m256i *)(src + i)), bswap);
+        if (alpha == ALPHABET_ASCII85 && _mm256_movemask_epi8(
+                _mm256_cmpeq_epi32(v, _mm256_setzero_si256()))) {
+            break;
+        }
+
+        q = div85_avx2(v);
+        last = _mm256_sub_epi32(v, mul85_avx2(q));
+        v = div85_avx2(q);
+        d = _mm256_slli_epi32(_mm256_sub_epi32(q, mul85_avx2(v)), 24);
+        q = div85_avx2(v);
+        d = _mm256_or_si256(d, _mm256_slli_epi32(_mm256_sub_epi32(v,
+                mul85_avx2(q)), 16));
+        v = div85_avx2(q);
+        d = _mm256_or_si256(d, _mm256_slli_epi32(_mm256_sub_epi32(q,
+                mul85_avx2(v)), 8));
+        d = _mm256_or_si256(d, v);
+
+        d = chars_avx2(d, alpha);
+        last = chars_avx2(last, alpha);
+
+        head = _mm256_or_si256(_mm256_shuffle_epi8(d, head_d),
+                _mm256_shuffle_epi8(last, head_last));
+        tail = _mm256_or_si256(_mm256_shuffle_epi8(d, tail_d),
+                _mm256_shuffle_epi8(last, tail_last));
+
+        _mm_storeu_si128((__m128i *)dest, _mm256_castsi256_si128(head));
+        store4_sse41(dest + 16, _mm256_castsi256_si128(tail));
+        _mm_storeu_si128((__m128i *)(dest + 20),
+                _mm256_extracti128_si256(head, 1));
+        store4_sse41(dest + 36, _mm256_extracti128_si256(tail, 1));
+        dest += 40;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t decode_avx2(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    const __m256i head_a = _mm256_setr_epi8(DECODE_HEAD, DECODE_HEAD);
+    const __m256i head_b = _mm256_setr_epi8(DECODE_HEAD_LAST,
+            DECODE_HEAD_LAST);
+    const __m256i last_b = _mm256_setr_epi8(DECODE_LAST, DECODE_LAST);
+    const __m256i high = _mm256_set1_epi32(BLOCK_MAX_HIGH);
+    apr_size_t i;
+
+    /* each lane takes four blocks, the upper loads read up to char 40 */
+    for (i = 0; slen - i >= 40; i += 40) {
+        __m256i a, b, va, vb, t, last, over;
+
+        a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(src + i))),
+                _mm_loadu_si128((const __m128i *)(src + i + 20)), 1);
+        b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)(src + i + 4))),
+                _mm_loadu_si128((const __m128i *)(src + i + 24)), 1);
+
+        a = values_avx2(a, alpha, &va);
+        b = values_avx2(b, alpha, &vb);
+        if (_mm256_movemask_epi8(_mm256_and_si256(va, vb)) != -1) {
+            break;
+        }
+
+        t = _mm256_or_si256(_mm256_shuffle_epi8(a, head_a),
+                _mm256_shuffle_epi8(b, head_b));
+        last = _mm256_shuffle_epi8(b, last_b);
+
+        t = _mm256_maddubs_epi16(t, _mm256_set1_epi16(0x0155));
+        t = _mm256_madd_epi16(t, _mm256_set1_epi32(0x00011c39));
+
+        over = _mm256_or_si256(_mm256_cmpgt_epi32(t, high),
+                _mm256_and_si256(_mm256_cmpeq_epi32(t, high),
+                _mm256_cmpgt_epi32(last, _mm256_setzero_si256())));
+        if (_mm256_movemask_epi8(over)) {
+            break;
+        }
+
+        t = _mm256_add_epi32(mul85_avx2(t), last);
+
+        _mm256_storeu_si256((__m256i *)dest, _mm256_shuffle_epi8(t,
+                _mm256_setr_epi8(BSWAP32, BSWAP32)));
+        dest += 32;
+    }
+
+    return i;
+}
+
+#endif
+
+static apr_size_t encode_none(char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    return 0;
+}
+
+static apr_size_t decode_none(unsigned char *dest, const unsigned char *src,
+        apr_size_t slen, int alpha)
+{
+    return 0;
+}
+
+static encode_fn encode_bulk = encode_none;
+static decode_fn decode_bulk = decode_none;
+
+void endec_base85_init(int cpu)
+{
+    char ascii85[85];
+    int i;
+
+    for (i = 0; i < 85; i++) {
+        ascii85[i] = '!' + i;
+    }
+
+    alphabet_make(&alphabets[ALPHABET_BASE85], "0123456789"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+            "!#$%&()*+-;<=>?@^_`{|}~");
+    alphabet_make(&alphabets[ALPHABET_Z85], "0123456789"
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            ".-:+=^!/*?&<>()[]{}@%$#");
+    alphabet_make(&alphabets[ALPHABET_ASCII85], ascii85);
+
+    encode_bulk = encode_none;
+    decode_bulk = decode_none;
+
+#if ENDEC_X86
+    if (cpu & (ENDEC_CPU_AVX2 | ENDEC_CPU_AVX512)) {
+        encode_bulk = encode_avx2;
+        decode_bulk = decode_avx2;
+    }
+    else if (cpu & ENDEC_CPU_SSE41) {
+        encode_bulk = encode_sse41;
+        decode_bulk = decode_sse41;
+    }
+#endif
+}
+
+apr_status_t endec_encode_base85(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    int alpha = alphabet(flags);
+    const char *chars = alphabets[alpha].chars;
+    char *out = dest, digits[5];
+    apr_uint32_t v = 0;
+    apr_size_t i = 0, n, rest;
+    int k;
+
+    /* the scalar code takes any block of zeros, and the end */
+    while (slen - i >= 4) {
+        n = encode_bulk(out, in + i, slen - i, alpha);
+        out += n / 4 * 5;
+        i += n;
+
+        n = (slen - i) / 4 * 4;
+        if (n > SCALAR_RUN) {
+            n = SCALAR_RUN;
+        }
+        out += encode_scalar(out, in + i, n, alpha);
+        i += n;
+    }
+
+    rest = slen - i;
+    if (rest) {
+        for (k = 0; k < 4; k++) {
+            v = (v << 8) | ((apr_size_t)k < rest ? in[i + k] : 0);
+        }
+        for (k = 4; k >= 0; k--) {
+            digits[k] = chars[v % 85];
+            v /= 85;
+        }
+        memcpy(out, digits, rest + 1);
+        out += rest + 1;
+    }
+
+    *len = out - dest;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_decode_base85(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dest;
+    int alpha = alphabet(flags);
+    const unsigned char *values = alphabets[alpha].values;
+    apr_uint64_t v = 0;
+    apr_size_t i = 0, n, l, rest, k;
+    unsigned int c;
+
+    while (i < slen) {
+        n = decode_bulk(out, in + i, slen - i, alpha);
+        out += n / 5 * 4;
+        i += n;
+
+        n = slen - i;
+        if (n > SCALAR_RUN) {
+            n = SCALAR_RUN;
+        }
+        n = decode_scalar(out, in + i, n, alpha, &l);
+        out += l;
+        i += n;
+
+        /* an invalid block, or the end */
+        if (!n) {
+            break;
+        }
+    }
+
+    rest = slen - i;
+    if (rest) {
+
+        /* a block cut short must hold at least one byte */
+        if (rest < 2 || rest > 4) {
+            return APR_BADCH;
+        }
+
+        for (k = 0; k < 5; k++) {
+            c = k < rest ? values[in[i + k]] : 84;
+            if (c == NOT_DIGIT) {
+                return APR_BADCH;
+            }
+            v = v * 85 + c;
+        }
+        if (v > 0xffffffff) {
+            return APR_BADCH;
+        }
+
+        for (k = 0; k < rest - 1; k++) {
+            *out++ = v >> (24 - 8 * k);
+        }
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
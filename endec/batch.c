@@ -0,0 +1,455 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - transform many files at a time
+ *
+ * The files are found by walking a directory, or are named one per line
+ * in a list. Each file is read whole and passed through a chain of its
+ * own, and the result is written alongside the file with a suffix added
+ * to its name. The files are shared out between a pool of threads, with
+ * the number of files waiting for a thread kept within bounds so that a
+ * long list is not held in memory all at once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#if APR_HAS_THREADS
+#include <apr_atomic.h>
+#endif
+
+#include "config.h"
+#include "endec.h"
+
+/* files waiting for a thread, for each thread */
+#define BATCH_QUEUE 4
+
+typedef struct batch_t {
+    apr_file_t *wr;
+    apr_file_t *err;
+    apr_array_header_t *stages;
+    const char *suffix;
+    int flags;
+    /* the number of files that could not be transformed */
+    volatile apr_uint32_t failed;
+#if APR_HAS_THREADS
+    apr_thread_pool_t *tp;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    /* files handed to the pool and not yet done */
+    int pending;
+    int most;
+#endif
+} batch_t;
+
+typedef struct batch_file_t {
+    batch_t *batch;
+    const char *path;
+} batch_file_t;
+
+/*
+ * Read the whole of the file into a buffer from the pool.
+ */
+static apr_status_t batch_read(apr_pool_t *pool, const char *path,
+        char **buffer, apr_size_t *size)
+{
+    apr_status_t status;
+    apr_file_t *rd;
+    apr_finfo_t finfo;
+    apr_size_t l;
+
+    status = apr_file_open(&rd, path, APR_FOPEN_READ, APR_OS_DEFAULT, pool);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, rd);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    if (finfo.size < 0 || (apr_uint64_t)finfo.size >= APR_SIZE_MAX) {
+        return APR_EINVAL;
+    }
+
+    *size = (apr_size_t)finfo.size;
+    *buffer = apr_palloc(pool, *size + 1);
+
+    status = apr_file_read_full(rd, *buffer, *size, &l);
+    if (status == APR_EOF && !*size) {
+        status = APR_SUCCESS;
+    }
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    return apr_file_close(rd);
+}
+
+static apr_status_t batch_write(apr_pool_t *pool, const char *path,
+        const char *data, apr_size_t len)
+{
+    apr_status_t status, rv;
+    apr_file_t *wr;
+    apr_size_t l;
+
+    status = apr_file_open(&wr, path,
+            APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE,
+            APR_OS_DEFAULT, pool);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_file_write_full(wr, data, len, &l);
+
+    rv = apr_file_close(wr);
+    if (status == APR_SUCCESS) {
+        status = rv;
+    }
+
+    /* leave no partial result behind */
+    if (status != APR_SUCCESS) {
+        apr_file_remove(path, pool);
+    }
+
+    return status;
+}
+
+/*
+ * Transform one file, reporting any failure. Returns non zero on failure.
+ */
+static int batch_one(batch_t *batch, const char *path)
+{
+    apr_pool_t *pool;
+    apr_status_t status;
+    endec_chain_t *chain;
+    endec_stage_t *stage, *model;
+    char *buffer;
+    const char *to;
+    apr_size_t size;
+    int i, failed = 0;
+
+    /* a pool of its own, as the threads cannot share one */
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        apr_file_printf(batch->err, "%s: Out of memory.\n", path);
+        return 1;
+    }
+
+    status = batch_read(pool, path, &buffer, &size);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(batch->err,
+                "Could not read '%s': %pm\n", path, &status);
+        apr_pool_destroy(pool);
+        return 1;
+    }
+
+    chain = endec_chain_make(pool, NULL, APR_SIZE_MAX);
+
+    if (batch->flags & (ENDEC_BATCH_CHECK | ENDEC_BATCH_LENGTH)) {
+        endec_chain_count(chain);
+    }
+    else {
+        endec_chain_capture(chain);
+    }
+
+    for (i = 0; i < batch->stages->nelts; i++) {
+        model = APR_ARRAY_IDX(batch->stages, i, endec_stage_t *);
+        stage = endec_stage_make(pool, model->opt);
+        if (model->wrap) {
+            endec_stage_wrap(stage, model->wrap);
+        }
+        endec_chain_add(chain, stage);
+    }
+
+    status = endec_chain_write(chain, buffer, size, 1);
+
+    if (chain->failed) {
+        apr_file_printf(batch->err, "%s: %s", path, chain->failed->error);
+        failed = 1;
+    }
+    else if (status != APR_SUCCESS) {
+        apr_file_printf(batch->err,
+                "Could not transform '%s': %pm\n", path, &status);
+        failed = 1;
+    }
+    else if (batch->flags & ENDEC_BATCH_LENGTH) {
+        apr_file_printf(batch->wr, "%" APR_UINT64_T_FMT " %s\n",
+                chain->total, path);
+    }
+    else if (!(batch->flags & ENDEC_BATCH_CHECK)) {
+
+        to = apr_pstrcat(pool, path, batch->suffix, NULL);
+
+        status = batch_write(pool, to, chain->obuf, chain->olen);
+        if (status != APR_SUCCESS) {
+            apr_file_printf(batch->err,
+                    "Could not write '%s': %pm\n", to, &status);
+            failed = 1;
+        }
+    }
+
+    apr_pool_destroy(pool);
+
+    return failed;
+}
+
+static void batch_done(batch_t *batch, int failed)
+{
+#if APR_HAS_THREADS
+    if (failed) {
+        apr_atomic_inc32(&batch->failed);
+    }
+#else
+    batch->failed += failed;
+#endif
+}
+
+#if APR_HAS_THREADS
+
+static void * APR_THREAD_FUNC batch_run(apr_thread_t *thread, void *data)
+{
+    batch_file_t *file = data;
+    batch_t *batch = file->batch;
+
+    batch_done(batch, batch_one(batch, file->path));
+
+    apr_thread_mutex_lock(batch->mutex);
+    batch->pending--;
+    apr_thread_cond_signal(batch->cond);
+    apr_thread_mutex_unlock(batch->mutex);
+
+    return NULL;
+}
+
+#endif
+
+/*
+ * Hand the file to a thread, waiting for room if too many are waiting
+ * already, or transform it here and now if there are no threads.
+ */
+static void batch_push(batch_t *batch, apr_pool_t *pool, const char *path)
+{
+#if APR_HAS_THREADS
+    batch_file_t *file;
+
+    if (batch->tp) {
+
+        file = apr_palloc(pool, sizeof(batch_file_t));
+        file->batch = batch;
+        file->path = path;
+
+        apr_thread_mutex_lock(batch->mutex);
+        while (batch->pending >= batch->most) {
+            apr_thread_cond_wait(batch->cond, batch->mutex);
+        }
+        batch->pending++;
+        apr_thread_mutex_unlock(batch->mutex);
+
+        if (apr_thread_pool_push(batch->tp, batch_run, file,
+                APR_THREAD_TASK_PRIORITY_NORMAL, NULL) != APR_SUCCESS) {
+            batch_run(NULL, file);
+        }
+
+        return;
+    }
+#endif
+
+    batch_done(batch, batch_one(batch, path));
+}
+
+static void batch_wait(batch_t *batch)
+{
+#if APR_HAS_THREADS
+    if (batch->tp) {
+        apr_thread_mutex_lock(batch->mutex);
+        while (batch->pending) {
+            apr_thread_cond_wait(batch->cond, batch->mutex);
+        }
+        apr_thread_mutex_unlock(batch->mutex);
+    }
+#endif
+}
+
+/*
+ * Is the name one of our own results?
+ */
+static int batch_result(batch_t *batch, const char *name)
+{
+    apr_size_t n = strlen(name), s = strlen(batch->suffix);
+
+    return s && n >= s && !strcmp(name + n - s, batch->suffix);
+}
+
+/*
+ * Transform the regular files below the directory, skipping the results
+ * of an earlier run.
+ */
+static apr_status_t batch_walk(batch_t *batch, apr_pool_t *pool,
+        const char *dirpath)
+{
+    apr_status_t status;
+    apr_pool_t *dpool;
+    apr_dir_t *dir;
+    apr_finfo_t finfo;
+    const char *path;
+
+    apr_pool_create(&dpool, pool);
+
+    status = apr_dir_open(&dir, dirpath, dpool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(batch->err,
+                "Could not open directory '%s': %pm\n", dirpath, &status);
+        batch_done(batch, 1);
+        apr_pool_destroy(dpool);
+        return status;
+    }
+
+    while ((status = apr_dir_read(&finfo, APR_FINFO_TYPE | APR_FINFO_NAME,
+            dir)) == APR_SUCCESS || status == APR_INCOMPLETE) {
+
+        if (!strcmp(finfo.name, ".") || !strcmp(finfo.name, "..")) {
+            continue;
+        }
+
+        if (finfo.filetype == APR_DIR) {
+            batch_walk(batch, pool,
+                    apr_pstrcat(dpool, dirpath, "/", finfo.name, NULL));
+        }
+        else if (finfo.filetype == APR_REG
+                && !batch_result(batch, finfo.name)) {
+
+            /* the path lives until the file is done, long after dpool */
+            path = apr_pstrcat(pool, dirpath, "/", finfo.name, NULL);
+
+            batch_push(batch, pool, path);
+        }
+    }
+
+    apr_pool_destroy(dpool);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Transform each file named in the list read from rd, one name per line.
+ */
+static apr_status_t batch_list(batch_t *batch, apr_pool_t *pool,
+        apr_file_t *rd)
+{
+    apr_status_t status;
+    char *buffer, *line, *end;
+    apr_size_t size = 0, len = 1024, l;
+
+    buffer = malloc(len);
+    if (!buffer) {
+        return APR_ENOMEM;
+    }
+
+    while ((status = apr_file_read_full(rd, buffer + size, len - size - 1,
+            &l)) == APR_SUCCESS) {
+
+        size += l;
+        len *= 2;
+
+        line = realloc(buffer, len);
+        if (!line) {
+            free(buffer);
+            return APR_ENOMEM;
+        }
+        buffer = line;
+    }
+    size += l;
+    buffer[size] = 0;
+
+    if (status != APR_EOF) {
+        free(buffer);
+        return status;
+    }
+
+    for (line = buffer; line < buffer + size; line = end + 1) {
+
+        end = memchr(line, '\n', buffer + size - line);
+        if (!end) {
+            end = buffer + size;
+        }
+
+        l = end - line;
+        if (l && line[l - 1] == '\r') {
+            l--;
+        }
+
+        if (l) {
+            batch_push(batch, pool, apr_pstrndup(pool, line, l));
+        }
+    }
+
+    free(buffer);
+
+    return APR_SUCCESS;
+}
+
+int endec_batch(apr_pool_t *pool, apr_file_t *rd, const char *rdpath,
+        apr_file_t *wr, apr_file_t *err, apr_array_header_t *stages,
+        const char *suffix, int threads, int flags)
+{
+    batch_t *batch = apr_pcalloc(pool, sizeof(batch_t));
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    batch->wr = wr;
+    batch->err = err;
+    batch->stages = stages;
+    batch->suffix = suffix;
+    batch->flags = flags;
+
+#if APR_HAS_THREADS
+    if (threads > 1) {
+        if ((status = apr_thread_mutex_create(&batch->mutex,
+                APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS
+                || (status = apr_thread_cond_create(&batch->cond,
+                pool)) != APR_SUCCESS
+                || (status = apr_thread_pool_create(&batch->tp, threads,
+                threads, pool)) != APR_SUCCESS) {
+            apr_file_printf(err, "Could not start threads: %pm\n", &status);
+            return 1;
+        }
+        batch->most = threads * BATCH_QUEUE;
+    }
+#endif
+
+    if (rdpath && apr_stat(&finfo, rdpath, APR_FINFO_TYPE, pool) == APR_SUCCESS
+            && finfo.filetype == APR_DIR) {
+        batch_walk(batch, pool, rdpath);
+    }
+    else if ((status = batch_list(batch, pool, rd)) != APR_SUCCESS) {
+        batch_wait(batch);
+        apr_file_printf(err, "Could not read the list of files: %pm\n",
+                &status);
+        return 1;
+    }
+
+    batch_wait(batch);
+
+    return batch->failed ? 1 : 0;
+}
@@ -0,0 +1,646 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec-bench - measure the speed of each endec transformation
+ *
+ * Each transformation is run over synthetic data from 16 bytes up to the
+ * largest size asked for, growing sixteen fold each time, in each of the
+ * mixes of characters below. Decoders and unescapes are given the data
+ * as encoded or escaped by their counterpart.
+ *
+ * A case is run over and over until it has taken at least the given
+ * time, and is reported as the throughput over the input, the time taken
+ * by each run, and the allocations made by each run once the buffers of
+ * the chain have been sized by a first run.
+ *
+ * The transformations are built with malloc() and friends renamed to the
+ * counting versions below, so that allocations made by APR itself are
+ * not counted.
+ */
+
+/* the counting versions call the real ones */
+#undef malloc
+#undef calloc
+#undef realloc
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_file_io.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "config.h"
+#include "endec.h"
+
+#define OPT_MIN_SIZE 'm'
+#define OPT_MAX_SIZE 'M'
+#define OPT_TIME 't'
+#define OPT_ONLY 'o'
+#define OPT_JSON_FILE 'j'
+
+/* smallest and largest data by default */
+#define BENCH_MIN_SIZE 16
+#define BENCH_MAX_SIZE (1024 * 1024 * 1024)
+
+/* least time spent on each case by default, in milliseconds */
+#define BENCH_TIME 100
+
+static const apr_getopt_option_t
+    cmdline_opts[] =
+{
+    {
+        "min-size",
+        OPT_MIN_SIZE,
+        1,
+        "  -m, --min-size bytes  Size of the smallest data. Defaults to 16."
+    },
+    {
+        "max-size",
+        OPT_MAX_SIZE,
+        1,
+        "  -M, --max-size bytes  Size of the largest data. Defaults to 1073741824."
+    },
+    {
+        "time",
+        OPT_TIME,
+        1,
+        "  -t, --time ms  Least time to spend on each case. Defaults to 100."
+    },
+    {
+        "only",
+        OPT_ONLY,
+        1,
+        "  -o, --only name  Only measure the transformations whose name contains the given text."
+    },
+    {
+        "json",
+        OPT_JSON_FILE,
+        1,
+        "  -j, --json file  Write the results as JSON to the given file."
+    },
+    {
+        "version",
+        'v',
+        0,
+        "  -v, --version  Display the version number."
+    },
+    {
+        "help",
+        'h',
+        0,
+        "  -h, --help  Display this help message."
+    },
+    { NULL }
+};
+
+/* the transformation only takes text, and is not given binary data */
+#define BENCH_TEXT 1
+
+typedef struct bench_def_t {
+    const char *name;
+    int opt;
+    /* the transformation that makes the input, or zero for the data */
+    int from;
+    /* the line width of the base64 encoder, or zero for one line */
+    apr_size_t wrap;
+    /* BENCH_TEXT, or zero */
+    int flags;
+} bench_def_t;
+
+static const bench_def_t bench_defs[] = {
+    { "url-escape", OPT_URL, 0, 0, 0 },
+    { "url-unescape", OPT_DECODE_URL, OPT_URL, 0, 0 },
+    { "form-escape", OPT_FORM, 0, 0, 0 },
+    { "form-unescape", OPT_DECODE_FORM, OPT_FORM, 0, 0 },
+    { "path-escape", OPT_PATH, 0, 0, 0 },
+    { "entity-escape", OPT_ENTITY, 0, 0, 0 },
+    { "entity-unescape", OPT_DECODE_ENTITY, OPT_ENTITY, 0, 0 },
+    { "echo-escape", OPT_ECHO, 0, 0, 0 },
+    { "echoquote-escape", OPT_ECHOQUOTE, 0, 0, 0 },
+    { "ldap-escape", OPT_LDAP, 0, 0, 0 },
+    { "ldapdn-escape", OPT_LDAP_DN, 0, 0, 0 },
+    { "ldapfilter-escape", OPT_LDAP_FILTER, 0, 0, 0 },
+    { "json-escape", OPT_JSON, 0, 0, 0 },
+    { "json-unescape", OPT_DECODE_JSON, OPT_JSON, 0, 0 },
+    { "utf8-validate", OPT_UTF8_VALIDATE, 0, 0, BENCH_TEXT },
+    { "base64-encode", OPT_BASE64, 0, 0, 0 },
+    { "base64url-encode", OPT_BASE64URL, 0, 0, 0 },
+    { "base64url-nopad-encode", OPT_BASE64URL_NOPAD, 0, 0, 0 },
+    { "base64-decode", OPT_DECODE_BASE64, OPT_BASE64, 0, 0 },
+    { "base64-wrap-encode", OPT_BASE64, 0, 76, 0 },
+    { "base64-wrapped-decode", OPT_DECODE_BASE64_WRAPPED, OPT_BASE64, 76, 0 },
+    { "base32-encode", OPT_BASE32, 0, 0, 0 },
+    { "base32hex-encode", OPT_BASE32HEX, 0, 0, 0 },
+    { "base32hex-nopad-encode", OPT_BASE32HEX_NOPAD, 0, 0, 0 },
+    { "base32-decode", OPT_DECODE_BASE32, OPT_BASE32, 0, 0 },
+    { "base32hex-decode", OPT_DECODE_BASE32HEX, OPT_BASE32HEX, 0, 0 },
+    { "base16-encode", OPT_BASE16, 0, 0, 0 },
+    { "base16colon-encode", OPT_BASE16COLON, 0, 0, 0 },
+    { "base16-lower-encode", OPT_BASE16LOWER, 0, 0, 0 },
+    { "base16colon-lower-encode", OPT_BASE16COLONLOWER, 0, 0, 0 },
+    { "base16-decode", OPT_DECODE_BASE16, OPT_BASE16, 0, 0 },
+    { "base85-encode", OPT_BASE85, 0, 0, 0 },
+    { "base85-decode", OPT_DECODE_BASE85, OPT_BASE85, 0, 0 },
+    { "z85-encode", OPT_Z85, 0, 0, 0 },
+    { "z85-decode", OPT_DECODE_Z85, OPT_Z85, 0, 0 },
+    { "ascii85-encode", OPT_ASCII85, 0, 0, 0 },
+    { "ascii85-decode", OPT_DECODE_ASCII85, OPT_ASCII85, 0, 0 },
+    { "sha256", OPT_SHA256, 0, 0, 0 },
+    { "sha1", OPT_SHA1, 0, 0, 0 },
+    { "md5", OPT_MD5, 0, 0, 0 },
+    { NULL }
+};
+
+typedef struct bench_mix_t {
+    const char *name;
+    /* the characters the data is drawn from, or NULL for any byte */
+    const char *chars;
+} bench_mix_t;
+
+static const bench_mix_t bench_mixes[] = {
+    { "ascii", "abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789" },
+    /* ascii with characters of two, three and four bytes */
+    { "utf8", "abcdefghijklmnopqrstuvwxyz0123456789 "
+            "\xc3\xa9\xc3\xbc\xc3\x9f\xce\xbb\xd0\x96"
+            "\xe2\x82\xac\xe4\xb8\xad\xe6\x96\x87\xed\x9f\xbf"
+            "\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf" },
+    { "binary", NULL },
+    { "escape", "<>&\"' %+/\\:;=?#\t\nab" },
+    { NULL }
+};
+
+/* allocations made by the transformations so far */
+static apr_size_t bench_allocs;
+
+void *endec_bench_malloc(size_t size);
+void *endec_bench_calloc(size_t nmemb, size_t size);
+void *endec_bench_realloc(void *ptr, size_t size);
+
+void *endec_bench_malloc(size_t size)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+void *endec_bench_calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return calloc(nmemb, size);
+}
+
+void *endec_bench_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return realloc(ptr, size);
+}
+
+static int help(apr_file_t *out, const char *name, const char *msg, int code,
+        const apr_getopt_option_t opts[])
+{
+    const char *n;
+    int i = 0;
+
+    n = strrchr(name, '/');
+    if (!n) {
+        n = name;
+    }
+    else {
+        n++;
+    }
+
+    apr_file_printf(out,
+            "%s\n"
+            "\n"
+            "NAME\n"
+            "  %s - Measure the speed of the endec transformations.\n"
+            "\n"
+            "SYNOPSIS\n"
+            "  %s [-v] [-h] [-m bytes] [-M bytes] [-t ms] [-o name] [-j file]\n"
+            "\n"
+            "DESCRIPTION\n"
+            "  The tool runs each transformation over synthetic ascii, utf8, binary and\n"
+            "  escape heavy data, from the smallest size up to the largest, growing\n"
+            "  sixteen fold each time. Decoders and unescapes are given the data as\n"
+            "  encoded or escaped by their counterpart. Transformations that only take\n"
+            "  text are not given the binary data.\n"
+            "\n"
+            "  Each case reports the throughput over the input in MB/s, the time taken by\n"
+            "  each run, and the allocations made by each run once the buffers have been\n"
+            "  sized by a first run.\n"
+            "\n"
+            "OPTIONS\n", msg ? msg : "", n, n);
+
+    while (opts[i].name) {
+        apr_file_printf(out, "%s\n\n", opts[i].description);
+        i++;
+    }
+
+    apr_file_printf(out,
+            "RETURN VALUE\n"
+            "  The endec-bench tool returns a non zero exit code if a transformation\n"
+            "  failed.\n"
+            "\n"
+            "AUTHOR\n"
+            "  Graham Leggett <minfrin@sharp.fm>\n");
+
+    return code;
+}
+
+static int version(apr_file_t *out)
+{
+    apr_file_printf(out, PACKAGE_STRING "\n");
+
+    return 0;
+}
+
+static int abortfunc(int retcode)
+{
+    fprintf(stderr, "Out of memory.");
+
+    return retcode;
+}
+
+static apr_status_t cleanup_buffer(void *dummy)
+{
+    free(dummy);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Fill the buffer with the same pseudo random data each time. A NUL
+ * follows the data.
+ */
+static void bench_fill(char *buf, apr_size_t len, const bench_mix_t *mix)
+{
+    apr_uint32_t x = 2463534242U;
+    apr_size_t n = mix->chars ? strlen(mix->chars) : 256;
+    apr_size_t i, k;
+    const char *c;
+
+    for (i = 0; i < len; i += k) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        if (!mix->chars) {
+            buf[i] = (char)(x >> 24);
+            k = 1;
+            continue;
+        }
+
+        /* a character of more than one byte is taken whole, if it fits */
+        c = mix->chars + (x >> 8) % n;
+        while ((*c & 0xc0) == 0x80) {
+            c--;
+        }
+        for (k = 1; (c[k] & 0xc0) == 0x80; k++);
+        if (k > len - i) {
+            c = mix->chars;
+            k = 1;
+        }
+        memcpy(buf + i, c, k);
+    }
+
+    buf[len] = 0;
+}
+
+/*
+ * Make a chain holding the one stage, gathering its output. A base64
+ * encoder breaks its output into lines of wrap characters.
+ */
+static endec_chain_t *bench_chain(apr_pool_t *pool, apr_file_t *out, int opt,
+        apr_size_t wrap)
+{
+    endec_chain_t *chain = endec_chain_make(pool, out, APR_SIZE_MAX);
+    endec_stage_t *stage = endec_stage_make(pool, opt);
+
+    if (wrap) {
+        endec_stage_wrap(stage, wrap);
+    }
+
+    endec_chain_add(chain, stage);
+    endec_chain_capture(chain);
+
+    return chain;
+}
+
+static apr_status_t bench_run(endec_chain_t *chain, const char *in,
+        apr_size_t inlen)
+{
+    endec_chain_reset(chain);
+
+    return endec_chain_write(chain, in, inlen, 1);
+}
+
+/*
+ * Report a case that could not be run, such as one whose buffers could not
+ * be reserved, and carry on with the rest.
+ */
+static void bench_skip(apr_file_t *out, apr_file_t *json,
+        const bench_def_t *def, const bench_mix_t *mix, apr_size_t size,
+        apr_status_t status, int *first)
+{
+    char buf[128];
+
+    apr_strerror(status, buf, sizeof(buf));
+
+    apr_file_printf(out, "%-26s %-7s %11" APR_SIZE_T_FMT " skipped: %s\n",
+            def->name, mix->name, size, buf);
+
+    if (json) {
+        apr_file_printf(json,
+                "%s\n    {\"name\": \"%s\", \"mix\": \"%s\", \"size\": %"
+                APR_SIZE_T_FMT ", \"skipped\": \"%s\"}", *first ? "" : ",",
+                def->name, mix->name, size, buf);
+        *first = 0;
+    }
+}
+
+static int bench_case(apr_pool_t *pool, apr_file_t *out, apr_file_t *err,
+        apr_file_t *json, const bench_def_t *def, const bench_mix_t *mix,
+        const char *data, apr_size_t size, apr_interval_time_t time,
+        int *first)
+{
+    endec_chain_t *chain;
+    const char *in = data;
+    apr_size_t inlen = size, outlen, setup, allocs;
+    apr_uint64_t ops = 0, n;
+    apr_time_t start, elapsed;
+    apr_status_t status;
+    double ns, mbs;
+
+    /* text is cut back to a whole number of characters */
+    if (def->flags & BENCH_TEXT) {
+        while (inlen && (in[inlen] & 0xc0) == 0x80) {
+            inlen--;
+        }
+    }
+
+    /* decoders are given the data as encoded by their counterpart */
+    if (def->from) {
+        chain = bench_chain(pool, out, def->from, def->wrap);
+        status = bench_run(chain, data, size);
+        if (status == APR_ENOMEM) {
+            bench_skip(out, json, def, mix, size, status, first);
+            return 0;
+        }
+        if (status != APR_SUCCESS || chain->failed) {
+            apr_file_printf(err, "Could not prepare %s: %s", def->name,
+                    chain->failed ? chain->failed->error : "write failed\n");
+            return 1;
+        }
+        in = chain->obuf;
+        inlen = chain->olen;
+    }
+
+    chain = bench_chain(pool, out, def->opt, def->from ? 0 : def->wrap);
+
+    /* the first run sizes the buffers, and is not timed */
+    setup = bench_allocs;
+    status = bench_run(chain, in, inlen);
+    setup = bench_allocs - setup;
+    if (status == APR_ENOMEM) {
+        bench_skip(out, json, def, mix, size, status, first);
+        return 0;
+    }
+    if (status != APR_SUCCESS || chain->failed) {
+        apr_file_printf(err, "Could not %s %s data: %s", def->name,
+                mix->name,
+                chain->failed ? chain->failed->error : "write failed\n");
+        return 1;
+    }
+    outlen = chain->olen;
+
+    allocs = bench_allocs;
+    start = apr_time_now();
+    n = 1;
+    do {
+        apr_uint64_t i;
+
+        for (i = 0; i < n; i++) {
+            bench_run(chain, in, inlen);
+        }
+        ops += n;
+        n *= 2;
+
+        elapsed = apr_time_now() - start;
+    } while (elapsed < time);
+    allocs = bench_allocs - allocs;
+
+    /* elapsed is in microseconds, and so bytes per microsecond is MB/s */
+    ns = (double)elapsed * 1000 / ops;
+    mbs = elapsed ? (double)inlen * ops / elapsed : 0;
+
+    apr_file_printf(out, "%-26s %-7s %11" APR_SIZE_T_FMT " %10.1f %14.1f %7.2f %6"
+            APR_SIZE_T_FMT "\n", def->name, mix->name, size, mbs, ns,
+            (double)allocs / ops, setup);
+
+    if (json) {
+        apr_file_printf(json,
+                "%s\n    {\"name\": \"%s\", \"mix\": \"%s\", \"size\": %"
+                APR_SIZE_T_FMT ", \"in_bytes\": %" APR_SIZE_T_FMT
+                ", \"out_bytes\": %" APR_SIZE_T_FMT ", \"ops\": %"
+                APR_UINT64_T_FMT ", \"ns_per_op\": %.1f, \"mb_per_s\": %.1f"
+                ", \"allocs_per_op\": %.2f, \"setup_allocs\": %"
+                APR_SIZE_T_FMT "}", *first ? "" : ",", def->name, mix->name,
+                size, inlen, outlen, ops, ns, mbs, (double)allocs / ops, setup);
+        *first = 0;
+    }
+
+    return 0;
+}
+
+static apr_status_t parse_size(const char *arg, apr_size_t *size)
+{
+    char *end;
+    apr_int64_t n = apr_strtoi64(arg, &end, 10);
+
+    if (*end || n < 1 || (apr_uint64_t)n > APR_SIZE_MAX) {
+        return APR_EINVAL;
+    }
+
+    *size = (apr_size_t)n;
+
+    return APR_SUCCESS;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_status_t status;
+    apr_pool_t *pool, *cpool;
+    apr_getopt_t *opt;
+    const char *optarg;
+    int optch;
+
+    apr_file_t *err;
+    apr_file_t *out;
+    apr_file_t *json = NULL;
+
+    apr_size_t min = BENCH_MIN_SIZE, max = BENCH_MAX_SIZE, size;
+    apr_interval_time_t time = apr_time_from_msec(BENCH_TIME);
+    const char *only = NULL;
+    const bench_def_t *def;
+    const bench_mix_t *mix;
+    char *data;
+    int first = 1;
+
+    /* lets get APR off the ground, and make sure it terminates cleanly */
+    if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (APR_SUCCESS != (status = apr_pool_create_ex(&pool, NULL, abortfunc, NULL))) {
+        return 1;
+    }
+
+    apr_file_open_stderr(&err, pool);
+    apr_file_open_stdout(&out, pool);
+
+    endec_kernels_init();
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        switch (optch) {
+        case OPT_MIN_SIZE: {
+            if (parse_size(optarg, &min) != APR_SUCCESS) {
+                return help(err, argv[0], "The minimum size must be a positive number.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+            break;
+        }
+        case OPT_MAX_SIZE: {
+            if (parse_size(optarg, &max) != APR_SUCCESS) {
+                return help(err, argv[0], "The maximum size must be a positive number.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+            break;
+        }
+        case OPT_TIME: {
+            char *end;
+            apr_int64_t n = apr_strtoi64(optarg, &end, 10);
+
+            if (*end || n < 0) {
+                return help(err, argv[0], "The time must be a number of milliseconds.",
+                        EXIT_FAILURE, cmdline_opts);
+            }
+            time = apr_time_from_msec(n);
+            break;
+        }
+        case OPT_ONLY: {
+            only = optarg;
+            break;
+        }
+        case OPT_JSON_FILE: {
+            if (APR_SUCCESS
+                    != (status = apr_file_open(&json, optarg,
+                            APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                                    | APR_FOPEN_TRUNCATE | APR_FOPEN_BUFFERED,
+                            APR_FPROT_OS_DEFAULT, pool))) {
+                apr_file_printf(err, "Could not open file '%s' for write: %pm\n",
+                        optarg, &status);
+                return 1;
+            }
+            break;
+        }
+        case 'v': {
+            version(out);
+            return 0;
+        }
+        case 'h': {
+            help(out, argv[0], NULL, 0, cmdline_opts);
+            return 0;
+        }
+        }
+
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, EXIT_FAILURE, cmdline_opts);
+    }
+    if (min > max) {
+        return help(err, argv[0], "The minimum size must not exceed the maximum size.",
+                EXIT_FAILURE, cmdline_opts);
+    }
+
+    data = malloc(max + 1);
+    if (!data) {
+        apr_file_printf(err, "Could not allocate %" APR_SIZE_T_FMT " bytes.\n",
+                max);
+        return 1;
+    }
+    apr_pool_cleanup_register(pool, data, cleanup_buffer, cleanup_buffer);
+
+    if (json) {
+        apr_file_printf(json, "{\n  \"tool\": \"endec-bench\",\n"
+                "  \"version\": \"" PACKAGE_VERSION "\",\n"
+                "  \"time_ms\": %" APR_INT64_T_FMT ",\n  \"results\": [",
+                (apr_int64_t)apr_time_as_msec(time));
+    }
+
+    apr_file_printf(out, "%-26s %-7s %11s %10s %14s %7s %6s\n", "name", "mix",
+            "size", "MB/s", "ns/op", "allocs", "setup");
+
+    apr_pool_create(&cpool, pool);
+
+    for (mix = bench_mixes; mix->name; mix++) {
+
+        bench_fill(data, max, mix);
+
+        for (def = bench_defs; def->name; def++) {
+
+            if (only && !strstr(def->name, only)) {
+                continue;
+            }
+            if (!mix->chars && (def->flags & BENCH_TEXT)) {
+                continue;
+            }
+
+            for (size = min;; size = (size > max / 16) ? max : size * 16) {
+
+                if (bench_case(cpool, out, err, json, def, mix, data, size,
+                        time, &first)) {
+                    return 1;
+                }
+                apr_pool_clear(cpool);
+
+                if (size == max) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (json) {
+        apr_file_printf(json, "\n  ]\n}\n");
+
+        if (APR_SUCCESS != (status = apr_file_close(json))) {
+            apr_file_printf(err, "Could not write JSON: %pm\n", &status);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - pick the kernels best suited to the CPU we are running on
+ *
+ */
+
+#include <apr.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <cpuid.h>
+#endif
+
+static int endec_cpu_features(void)
+{
+    int cpu = 0;
+
+#if ENDEC_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.1")) {
+        cpu |= ENDEC_CPU_SSE41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        cpu |= ENDEC_CPU_AVX2;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vbmi")) {
+        cpu |= ENDEC_CPU_AVX512;
+    }
+    /* not every compiler knows the SHA extensions by name */
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+            && (ebx & (1 << 29))) {
+        cpu |= ENDEC_CPU_SHA;
+    }
+#endif
+
+    return cpu;
+}
+
+void endec_kernels_init(void)
+{
+    int cpu = endec_cpu_features();
+
+    endec_base64_init(cpu);
+    endec_base32_init(cpu);
+    endec_base16_init(cpu);
+    endec_base85_init(cpu);
+    endec_escape_init(cpu);
+    endec_utf8_init(cpu);
+    endec_sha256_init(cpu);
+}
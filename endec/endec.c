@@ -28,38 +28,14 @@
 #include <apr_escape.h>
 #include <apr_file_io.h>
 #include <apr_getopt.h>
+#include <apr_mmap.h>
 #include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "config.h"
+#include "endec.h"
 
 
-#define OPT_URL 'u'
-#define OPT_DECODE_URL 'U'
-#define OPT_FORM 'f'
-#define OPT_DECODE_FORM 'F'
-#define OPT_PATH 'p'
-#define OPT_ENTITY 'e'
-#define OPT_DECODE_ENTITY 'E'
-#define OPT_ECHO 'c'
-#define OPT_ECHOQUOTE 244
-#define OPT_LDAP 'l'
-#define OPT_LDAP_DN 245
-#define OPT_LDAP_FILTER 246
-#define OPT_BASE64 'b'
-#define OPT_BASE64URL 247
-#define OPT_BASE64URL_NOPAD 248
-#define OPT_DECODE_BASE64 'B'
-#define OPT_BASE32 't'
-#define OPT_BASE32HEX 249
-#define OPT_BASE32HEX_NOPAD 250
-#define OPT_DECODE_BASE32 'T'
-#define OPT_DECODE_BASE32HEX 251
-#define OPT_BASE16 's'
-#define OPT_BASE16COLON 254
-#define OPT_BASE16LOWER 253
-#define OPT_BASE16COLONLOWER 252
-#define OPT_DECODE_BASE16 'S'
-
 static const apr_getopt_option_t
     cmdline_opts[] =
 {
@@ -136,6 +112,42 @@ static const apr_getopt_option_t
         0,
         "  --ldapfilter-escape  LDAP escape filter data as per RFC4515"
     },
+    {
+        "json-escape",
+        OPT_JSON,
+        0,
+        "  --json-escape  Escape data for use within a JSON string as per RFC8259, escaping quotes, backslashes and control characters"
+    },
+    {
+        "json-unescape",
+        OPT_DECODE_JSON,
+        0,
+        "  --json-unescape  Unescape the contents of a JSON string, writing \\uXXXX escapes and surrogate pairs as UTF-8"
+    },
+    {
+        "utf8-validate",
+        OPT_UTF8_VALIDATE,
+        0,
+        "  --utf8-validate  Pass on data unchanged if it is valid UTF-8 as per RFC3629, otherwise fail giving the byte offset of the first invalid sequence. Place before --json-escape or --entity-escape to accept only valid UTF-8"
+    },
+    {
+        "sha256",
+        OPT_SHA256,
+        0,
+        "  --sha256  Digest data with SHA-256 as per FIPS 180-4, passing on the 32 byte digest, to be encoded by the transformations that follow"
+    },
+    {
+        "sha1",
+        OPT_SHA1,
+        0,
+        "  --sha1  Digest data with SHA-1 as per FIPS 180-4, passing on the 20 byte digest, to be encoded by the transformations that follow"
+    },
+    {
+        "md5",
+        OPT_MD5,
+        0,
+        "  --md5  Digest data with MD5 as per RFC1321, passing on the 16 byte digest, to be encoded by the transformations that follow"
+    },
     {
         "base64-encode",
         OPT_BASE64,
@@ -160,6 +172,18 @@ static const apr_getopt_option_t
         0,
         "  -B, --base64-decode  Decode data as base64 or base64url"
     },
+    {
+        "base64-wrapped-decode",
+        OPT_DECODE_BASE64_WRAPPED,
+        0,
+        "  --base64-wrapped-decode  Decode data as base64 or base64url broken into lines, skipping any spaces, tabs, carriage returns and newlines"
+    },
+    {
+        "base64-wrap",
+        OPT_BASE64_WRAP,
+        1,
+        "  --base64-wrap n  Break the output of the base64 and base64url encoders into lines of n characters, each ended with a newline, as MIME and PEM expect. Zero leaves the output unbroken."
+    },
     {
         "base32-encode",
         OPT_BASE32,
@@ -220,6 +244,120 @@ static const apr_getopt_option_t
         0,
         "  -S, --base16-decode  Decode data as base16"
     },
+    {
+        "base85-encode",
+        OPT_BASE85,
+        0,
+        "  --base85-encode  Encode data as base85 with the alphabet of RFC1924"
+    },
+    {
+        "base85-decode",
+        OPT_DECODE_BASE85,
+        0,
+        "  --base85-decode  Decode data as base85"
+    },
+    {
+        "z85-encode",
+        OPT_Z85,
+        0,
+        "  --z85-encode  Encode data as Z85 as per ZeroMQ RFC 32, ending data that is not a multiple of four bytes long with a partial block"
+    },
+    {
+        "z85-decode",
+        OPT_DECODE_Z85,
+        0,
+        "  --z85-decode  Decode data as Z85"
+    },
+    {
+        "ascii85-encode",
+        OPT_ASCII85,
+        0,
+        "  --ascii85-encode  Encode data as Ascii85, with no delimiters"
+    },
+    {
+        "ascii85-decode",
+        OPT_DECODE_ASCII85,
+        0,
+        "  --ascii85-decode  Decode data as Ascii85, with no delimiters"
+    },
+    {
+        "stream",
+        OPT_STREAM,
+        0,
+        "  --stream  Transform the data in chunks as it is read, rather than reading all data before transforming it. Memory use stays bounded regardless of the size of the data, and output is written as soon as it is available. If invalid data is encountered, output already written remains written."
+    },
+    {
+        "threads",
+        OPT_THREADS,
+        1,
+        "  --threads n  Split base64, base32 and base16 encoding and decoding of large data across n threads. The result is the same as with a single thread."
+    },
+    {
+        "records",
+        OPT_RECORDS,
+        0,
+        "  --records  Treat the data as records separated by newlines, transforming each record on its own. Each result is followed by a newline."
+    },
+    {
+        "null",
+        OPT_NULL,
+        0,
+        "  --null  With --records, records are separated by NUL characters rather than newlines."
+    },
+    {
+        "serve",
+        OPT_SERVE,
+        0,
+        "  --serve  Answer framed requests until the input is closed. Each request is a frame holding the transformation options, followed by a frame holding the data. Each response is a frame holding any error, followed by a frame holding the result. A frame is a 32 bit length in native byte order followed by the data. Options of more than 4096 bytes, or data of more than 64 MiB, are answered with an error."
+    },
+    {
+        "pipeline",
+        OPT_PIPELINE,
+        0,
+        "  --pipeline  Stream the data as with --stream, reading and writing on threads of their own so that input, output and the transformations overlap."
+    },
+    {
+        "stats",
+        OPT_STATS,
+        0,
+        "  --stats  Once done, report the calls, bytes in and out, wall and CPU time, throughput and buffer memory of each transformation, and of reading, transforming and writing as a whole, on stderr. CPU time is that of the whole process."
+    },
+    {
+        "stats-json",
+        OPT_STATS_JSON,
+        0,
+        "  --stats-json  As --stats, with the report written as JSON."
+    },
+    {
+        "check",
+        OPT_CHECK,
+        0,
+        "  --check  Check that the data can be transformed, writing nothing. The exit code is non zero if the data is invalid. Without --stream the data is read whole first, so add --stream to keep memory use bounded."
+    },
+    {
+        "length",
+        OPT_LENGTH,
+        0,
+        "  --length  Write the size in bytes of the result, rather than the result. Where the last transformation is an encoder, the size is worked out from the size of its input. Without --stream the data is read whole first, so add --stream to keep memory use bounded."
+    },
+    {
+        "batch",
+        OPT_BATCH,
+        0,
+        "  --batch  Transform many files, each read whole. When --read names a directory, each regular file below it is transformed, otherwise the files are named one per line in the file read. Each result is written to the name of the file with a suffix added. The files are shared between the number of threads given by --threads. The exit code is non zero if any file could not be transformed."
+    },
+    {
+        "suffix",
+        OPT_SUFFIX,
+        1,
+        "  --suffix ext  With --batch, the suffix added to the name of each file to name its result. Files ending with the suffix are skipped when walking a directory. Defaults to '.out'."
+    },
+    {
+        "tee",
+        OPT_TEE,
+        0,
+        "  --tee  Start a branch. The transformations and --write that follow belong to the branch. The result of the transformations before the first --tee is passed to each branch in turn, so that they run only once. Each branch writes to stdout unless given a --write of its own, which is created or truncated."
+    },
     {
         "read",
         'r',
@@ -305,6 +443,156 @@ static int version(apr_file_t *out)
     return 0;
 }
 
+/*
+ * A branch started with --tee, with its own transformations and
+ * destination.
+ */
+typedef struct tee_t {
+    apr_array_header_t *stages;
+    apr_file_t *wr;
+} tee_t;
+
+static const char *opt_name(const apr_getopt_option_t opts[], int opt)
+{
+    int i;
+
+    for (i = 0; opts[i].name; i++) {
+        if (opts[i].optch == opt) {
+            return opts[i].name;
+        }
+    }
+
+    return "";
+}
+
+/*
+ * Report one line of stats, as text or as JSON.
+ */
+static void stats_line(apr_file_t *err, int json, const char *name,
+        const endec_stats_t *st, apr_size_t memory, int first)
+{
+    double wall = st->wall / 1000.0;
+    double cpu = st->cpu * 1000.0 / CLOCKS_PER_SEC;
+    double mbs = st->wall ? (double)st->in / st->wall : 0;
+
+    if (json) {
+        apr_file_printf(err, "%s    {\"name\": \"%s\", \"calls\": %"
+                APR_UINT64_T_FMT ", \"in_bytes\": %" APR_UINT64_T_FMT
+                ", \"out_bytes\": %" APR_UINT64_T_FMT ", \"wall_ms\": %.3f"
+                ", \"cpu_ms\": %.3f, \"mb_per_s\": %.1f, \"memory\": %"
+                APR_SIZE_T_FMT "}", first ? "" : ",\n", name, st->calls,
+                st->in, st->out, wall, cpu, mbs, memory);
+    }
+    else {
+        apr_file_printf(err, "%-36s %8" APR_UINT64_T_FMT " %14"
+                APR_UINT64_T_FMT " %14" APR_UINT64_T_FMT " %11.3f %11.3f"
+                " %10.1f %11" APR_SIZE_T_FMT "\n", name, st->calls, st->in,
+                st->out, wall, cpu, mbs, memory);
+    }
+}
+
+/*
+ * Report each stage of the chain, named after label when set, and add
+ * the stages to the totals.
+ */
+static void stats_stages(apr_file_t *err, int json, endec_chain_t *chain,
+        const char *label, endec_stats_t *total, apr_size_t *all,
+        int *first, const apr_getopt_option_t opts[])
+{
+    endec_stage_t *stage;
+    apr_size_t memory;
+    const char *name;
+
+    /* buffers shared by the stages */
+    *all += chain->turnsize[0] + chain->turnsize[1] + chain->osize
+            + chain->recsize;
+
+    for (stage = chain->first; stage; stage = stage->next) {
+
+        name = opt_name(opts, stage->opt);
+        if (stage->fused) {
+            name = apr_pstrcat(chain->pool, name, "+",
+                    opt_name(opts, stage->fused->opt), NULL);
+        }
+        if (label) {
+            name = apr_pstrcat(chain->pool, label, name, NULL);
+        }
+
+        memory = stage->size + stage->outsize + stage->stripsize
+                + (stage->replace ? sizeof(endec_replace_t) : 0);
+        *all += memory;
+
+        stats_line(err, json, name, stage->stats, memory, *first);
+        *first = 0;
+
+        total->calls += stage->stats->calls;
+        total->wall += stage->stats->wall;
+        total->cpu += stage->stats->cpu;
+    }
+}
+
+/*
+ * Report the time and bytes spent in each stage, then in reading, in
+ * transforming as a whole, and in writing. The stages of each branch
+ * follow the stages they share.
+ */
+static void stats_report(apr_file_t *err, int json, endec_chain_t *chain,
+        const apr_getopt_option_t opts[])
+{
+    endec_chain_t *branch;
+    endec_stats_t total = { 0 }, written = { 0 };
+    apr_size_t all = 0;
+    apr_uint64_t out;
+    int i, first = 1;
+
+    if (json) {
+        apr_file_printf(err, "{\n  \"stages\": [\n");
+    }
+    else {
+        apr_file_printf(err, "%-36s %8s %14s %14s %11s %11s %10s %11s\n",
+                "stage", "calls", "bytes in", "bytes out", "wall ms",
+                "cpu ms", "MB/s", "memory");
+    }
+
+    stats_stages(err, json, chain, NULL, &total, &all, &first, opts);
+
+    /* the transformation as a whole takes what the first stage takes */
+    total.in = chain->first ? chain->first->stats->in : chain->rstats->in;
+    out = chain->last ? chain->last->stats->out : total.in;
+
+    if (!chain->branches) {
+        total.out = out;
+        written = *chain->wstats;
+    }
+
+    for (i = 0; chain->branches && i < chain->branches->nelts; i++) {
+        branch = APR_ARRAY_IDX(chain->branches, i, endec_chain_t *);
+
+        stats_stages(err, json, branch,
+                apr_psprintf(chain->pool, "tee %d: ", i + 1), &total, &all,
+                &first, opts);
+
+        total.out += branch->last ? branch->last->stats->out : out;
+
+        written.calls += branch->wstats->calls;
+        written.in += branch->wstats->in;
+        written.wall += branch->wstats->wall;
+        written.cpu += branch->wstats->cpu;
+    }
+
+    if (json) {
+        apr_file_printf(err, "\n  ],\n  \"phases\": [\n");
+    }
+
+    stats_line(err, json, "read", chain->rstats, 0, 1);
+    stats_line(err, json, "transform", &total, all, 0);
+    stats_line(err, json, "write", &written, 0, 0);
+
+    if (json) {
+        apr_file_printf(err, "\n  ]\n}\n");
+    }
+}
+
 static int abortfunc(int retcode)
 {
     fprintf(stderr, "Out of memory.");
@@ -319,6 +607,63 @@ static apr_status_t cleanup_buffer(void *dummy)
     return APR_SUCCESS;
 }
 
+/*
+ * Map a regular file into memory, so that it can be transformed where it
+ * lies rather than being read into a buffer. Anything else, such as a
+ * pipe or a tty, must be read.
+ */
+static apr_status_t map_source(apr_file_t *rd, apr_pool_t *pool,
+        char **buffer, apr_size_t *size)
+{
+#if APR_HAS_MMAP
+    apr_status_t status;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+
+    status = apr_file_info_get(&finfo, APR_FINFO_TYPE | APR_FINFO_SIZE, rd);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    /* empty files cannot be mapped */
+    if (finfo.filetype != APR_REG || finfo.size <= 0
+            || (apr_uint64_t)finfo.size > APR_SIZE_MAX) {
+        return APR_EINVAL;
+    }
+
+    status = apr_mmap_create(&mm, rd, 0, (apr_size_t)finfo.size,
+            APR_MMAP_READ, pool);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    *buffer = mm->mm;
+    *size = mm->size;
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+/*
+ * Break the output of each base64 encoder among the stages into lines,
+ * returning the number of encoders found.
+ */
+static int wrap_stages(apr_array_header_t *stages, apr_size_t width)
+{
+    int i, found = 0;
+
+    for (i = 0; i < stages->nelts; i++) {
+        if (endec_stage_wrap(APR_ARRAY_IDX(stages, i, endec_stage_t *),
+                width) == APR_SUCCESS) {
+            found++;
+        }
+    }
+
+    return found;
+}
+
 int main(int argc, const char * const argv[])
 {
     apr_status_t status;
@@ -333,9 +678,28 @@ int main(int argc, const char * const argv[])
     apr_file_t *wr;
     apr_file_t *rd;
 
+    endec_chain_t *chain;
     char *buffer;
-    const char *result;
-    apr_size_t size = 0, l;
+    apr_size_t size = 0, l, chunk;
+    int stream = 0;
+    int threads = 1;
+    int mapped = 0;
+    int chunked = 0;
+    int records = 0;
+    int serve = 0;
+    int pipeline = 0;
+    int stats = 0;
+    int check = 0;
+    int length = 0;
+    int batch = 0;
+    apr_int64_t wrap = -1;
+    const char *rdpath = NULL;
+    const char *suffix = ENDEC_BATCH_SUFFIX;
+    int i, j;
+    apr_array_header_t *stages;
+    apr_array_header_t *tees;
+    tee_t *tee = NULL;
+    char delim = '\n';
 
     /* lets get APR off the ground, and make sure it terminates cleanly */
     if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
@@ -351,9 +715,14 @@ int main(int argc, const char * const argv[])
     apr_file_open_stdin(&in, pool);
     apr_file_open_stdout(&out, pool);
 
+    endec_kernels_init();
+
     rd = in;
     wr = out;
 
+    stages = apr_array_make(pool, 8, sizeof(endec_stage_t *));
+    tees = apr_array_make(pool, 4, sizeof(tee_t));
+
     apr_getopt_init(&opt, pool, argc, argv);
     while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
             == APR_SUCCESS) {
@@ -367,11 +736,14 @@ int main(int argc, const char * const argv[])
                         "Could not open file '%s' for read: %pm\n", optarg, &status);
                 return 1;
             }
+            rdpath = optarg;
             break;
         }
         case 'w': {
-            status = apr_file_open(&wr, optarg, APR_FOPEN_WRITE,
-                    APR_OS_DEFAULT, pool);
+            /* a branch writes to its own destination, made afresh */
+            status = apr_file_open(tee ? &tee->wr : &wr, optarg,
+                    tee ? APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE
+                            : APR_FOPEN_WRITE, APR_OS_DEFAULT, pool);
             if (status != APR_SUCCESS) {
                 apr_file_printf(err,
                         "Could not open file '%s' for write: %pm\n", optarg, &status);
@@ -379,391 +751,331 @@ int main(int argc, const char * const argv[])
             }
             break;
         }
-        case 'v': {
-            version(out);
-            return 0;
+        case OPT_STREAM: {
+            stream = 1;
+            break;
         }
-        case 'h': {
-            help(out, argv[0], NULL, 0, cmdline_opts);
-            return 0;
+        case OPT_RECORDS: {
+            records = 1;
+            break;
         }
+        case OPT_NULL: {
+            delim = 0;
+            break;
         }
-
-    }
-    if (APR_SUCCESS != status && APR_EOF != status) {
-        return help(err, argv[0], NULL, EXIT_FAILURE, cmdline_opts);
-    }
-
-    /* read the source */
-    if (opt->ind < argc) {
-        char *off;
-        int ind = opt->ind;
-
-        while (ind < argc) {
-            if (ind > opt->ind) {
-                size++;
-            }
-            size += strlen(opt->argv[ind]);
-            ind++;
+        case OPT_SERVE: {
+            serve = 1;
+            break;
         }
-
-        off = buffer = malloc(size + 1);
-        ind = opt->ind;
-
-        while (ind < argc) {
-            if (ind > opt->ind) {
-                strcpy(off++, " ");
-            }
-            strcpy(off, opt->argv[ind]);
-            off += strlen(opt->argv[ind]);
-            ind++;
+        case OPT_PIPELINE: {
+#if !APR_HAS_THREADS
+            apr_file_printf(err,
+                    "The --pipeline option needs threads, which this build lacks.\n");
+            return 1;
+#endif
+            pipeline = 1;
+            stream = 1;
+            break;
         }
-
-    } else {
-        char *off;
-        apr_size_t len = 1024;
-
-        off = buffer = malloc(len);
-
-        while (APR_SUCCESS
-                == (status = apr_file_read_full(rd, off, len - (off - buffer) - 1,
-                        &l))) {
-
-            size += l;
-            len *= 2;
-
-            buffer = realloc(buffer, len);
-            if (!buffer) {
-                return 1;
-            }
-
-            off = buffer + size;
+        case OPT_STATS: {
+            stats = 1;
+            break;
         }
-
-        size += l;
-
-        buffer[size] = 0;
-
-    }
-
-    apr_pool_cleanup_register(pool, buffer, cleanup_buffer, cleanup_buffer);
-    result = buffer;
-
-    /* apply the transformation */
-    apr_getopt_init(&opt, pool, argc, argv);
-    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
-            == APR_SUCCESS) {
-
-        switch (optch) {
-        case OPT_URL: {
-
-            result = apr_pescape_path_segment(pool, result);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not url escape data.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_STATS_JSON: {
+            stats = 2;
             break;
         }
-        case OPT_DECODE_URL: {
-
-            result = apr_punescape_url(pool, result, NULL, NULL, 0);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not url unescape data.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_CHECK: {
+            check = 1;
             break;
         }
-        case OPT_FORM: {
-
-            result = apr_pescape_urlencoded(pool, result);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not form url escape data.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_LENGTH: {
+            length = 1;
             break;
         }
-        case OPT_DECODE_FORM: {
-
-            result = apr_punescape_url(pool, result, NULL, NULL, 1);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not form url unescape data.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_BATCH: {
+            batch = 1;
             break;
         }
-        case OPT_PATH: {
-
-            result = apr_pescape_path(pool, result, 1);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not escape the path.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_SUFFIX: {
+            suffix = optarg;
             break;
         }
-        case OPT_ENTITY: {
-
-            result = apr_pescape_entity(pool, result, 1);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not entity escape data.\n");
-                return 1;
-            }
-            size = strlen(result);
-
+        case OPT_TEE: {
+            tee = apr_array_push(tees);
+            tee->stages = apr_array_make(pool, 8, sizeof(endec_stage_t *));
+            tee->wr = out;
             break;
         }
-        case OPT_DECODE_ENTITY: {
-
-            result = apr_punescape_entity(pool, result);
-            if (!result) {
+        case OPT_BASE64_WRAP: {
+            char *end;
+            wrap = apr_strtoi64(optarg, &end, 10);
+            if (*end || wrap < 0 || wrap > 1048576) {
                 apr_file_printf(err,
-                        "Could not entity unescape data.\n");
+                        "Line length '%s' must be between 0 and 1048576.\n", optarg);
                 return 1;
             }
-            size = strlen(result);
-
             break;
         }
-        case OPT_ECHO: {
-
-            result = apr_pescape_echo(pool, result, 0);
-            if (!result) {
+        case OPT_THREADS: {
+            char *end;
+            apr_int64_t n = apr_strtoi64(optarg, &end, 10);
+            if (*end || n < 1 || n > 1024) {
                 apr_file_printf(err,
-                        "Could not echo escape data.\n");
+                        "Thread count '%s' must be between 1 and 1024.\n", optarg);
                 return 1;
             }
-            size = strlen(result);
-
-            break;
-        }
-        case OPT_ECHOQUOTE: {
-
-            result = apr_pescape_echo(pool, result, 1);
-            if (!result) {
+#if !APR_HAS_THREADS
+            if (n > 1) {
                 apr_file_printf(err,
-                        "Could not quote echo escape data.\n");
+                        "The --threads option needs threads, which this build lacks.\n");
                 return 1;
             }
-            size = strlen(result);
-
+#endif
+            threads = (int)n;
             break;
         }
-        case OPT_LDAP: {
+        case 'v': {
+            version(out);
+            return 0;
+        }
+        case 'h': {
+            help(out, argv[0], NULL, 0, cmdline_opts);
+            return 0;
+        }
+        default: {
+            endec_stage_t *stage = endec_stage_make(pool, optch);
 
-            result = apr_pescape_ldap(pool, result, size, APR_ESCAPE_LDAP_ALL);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not ldap escape data.\n");
-                return 1;
+            if (stage) {
+                APR_ARRAY_PUSH(tee ? tee->stages : stages,
+                        endec_stage_t *) = stage;
             }
-            size = strlen(result);
 
             break;
         }
-        case OPT_LDAP_DN: {
+        }
 
-            result = apr_pescape_ldap(pool, result, size, APR_ESCAPE_LDAP_DN);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not ldap escape distinguished name data.\n");
-                return 1;
-            }
-            size = strlen(result);
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, EXIT_FAILURE, cmdline_opts);
+    }
 
-            break;
-        }
-        case OPT_LDAP_FILTER: {
+    if (tees->nelts && (serve || batch || records || check || length)) {
+        apr_file_printf(err, "The --tee option cannot be combined with "
+                "--serve, --batch, --records, --check or --length.\n");
+        return 1;
+    }
 
-            result = apr_pescape_ldap(pool, result, size, APR_ESCAPE_LDAP_FILTER);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not ldap escape filter data.\n");
-                return 1;
-            }
-            size = strlen(result);
+    /* requests name their own transformations */
+    if (serve) {
+        return endec_serve(pool, rd, wr, err, cmdline_opts);
+    }
 
-            break;
-        }
-        case OPT_BASE64: {
+    /* the base64 encoders break their output into lines */
+    if (wrap >= 0) {
+        int found = wrap_stages(stages, (apr_size_t)wrap);
 
-            result = apr_pencode_base64(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base64 encode data.\n");
-                return 1;
-            }
+        for (i = 0; i < tees->nelts; i++) {
+            found += wrap_stages(APR_ARRAY_IDX(tees, i, tee_t).stages,
+                    (apr_size_t)wrap);
+        }
 
-            break;
+        if (!found) {
+            apr_file_printf(err, "The --base64-wrap option needs a base64 "
+                    "or base64url encoding.\n");
+            return 1;
         }
-        case OPT_BASE64URL: {
+    }
 
-            result = apr_pencode_base64(pool, result, size, APR_ENCODE_URL, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base64url encode data.\n");
-                return 1;
-            }
+    /* each file is transformed whole, with the result alongside */
+    if (batch) {
+        return endec_batch(pool, rd, rdpath, wr, err, stages, suffix,
+                threads, (check ? ENDEC_BATCH_CHECK : 0)
+                        | (length ? ENDEC_BATCH_LENGTH : 0));
+    }
 
-            break;
-        }
-        case OPT_BASE64URL_NOPAD: {
+    /* each thread needs a decent piece of each chunk to work on */
+    if (!stream) {
+        chunk = APR_SIZE_MAX;
+    }
+    else if (threads > 1) {
+        chunk = threads * ENDEC_PIECE_SIZE;
+    }
+    else {
+        chunk = ENDEC_CHUNK_SIZE;
+    }
 
-            result = apr_pencode_base64(pool, result, size, APR_ENCODE_BASE64URL, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base64url encode data with no padding.\n");
-                return 1;
-            }
+    /* set up the transformations, records are transformed whole */
+    chain = endec_chain_make(pool, wr, stream ? chunk : APR_SIZE_MAX);
 
-            break;
+    /* the result is counted rather than written */
+    if (check || length) {
+        endec_chain_count(chain);
+    }
+
+    if (records) {
+        status = endec_chain_records(chain, delim);
+        if (status != APR_SUCCESS) {
+            apr_file_printf(err, "Could not set up records: %pm\n", &status);
+            return 1;
         }
-        case OPT_DECODE_BASE64: {
+    }
 
-            result = apr_pdecode_base64(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base64 decode data, bad characters encountered.\n");
-                return 1;
-            }
+    status = endec_chain_threads(chain, threads);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not start threads: %pm\n", &status);
+        return 1;
+    }
 
-            break;
-        }
-        case OPT_BASE32: {
+    for (i = 0; i < stages->nelts; i++) {
+        endec_chain_add(chain, APR_ARRAY_IDX(stages, i, endec_stage_t *));
+    }
 
-            result = apr_pencode_base32(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base64 encode data.\n");
-                return 1;
-            }
+    /* the result of the shared stages goes to each branch */
+    for (i = 0; i < tees->nelts; i++) {
+        endec_chain_t *branch;
 
-            break;
+        tee = &APR_ARRAY_IDX(tees, i, tee_t);
+        branch = endec_chain_tee(chain, tee->wr);
+
+        for (j = 0; j < tee->stages->nelts; j++) {
+            endec_chain_add(branch,
+                    APR_ARRAY_IDX(tee->stages, j, endec_stage_t *));
         }
-        case OPT_BASE32HEX: {
+    }
 
-            result = apr_pencode_base32(pool, result, size, APR_ENCODE_BASE32HEX, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base32hex encode data.\n");
-                return 1;
-            }
+    if (stats) {
+        endec_chain_stats(chain);
+    }
 
-            break;
-        }
-        case OPT_BASE32HEX_NOPAD: {
+    /* read the source */
+    endec_stats_begin(chain->rstats);
+    if (opt->ind < argc) {
+        char *off;
+        int ind = opt->ind;
 
-            result = apr_pencode_base32(pool, result, size, APR_ENCODE_BASE32HEX | APR_ENCODE_NOPADDING, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base32hex encode data with no padding.\n");
-                return 1;
+        while (ind < argc) {
+            if (ind > opt->ind) {
+                size++;
             }
-
-            break;
+            size += strlen(opt->argv[ind]);
+            ind++;
         }
-        case OPT_DECODE_BASE32: {
 
-            result = apr_pdecode_base32(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base32 decode data, bad characters encountered.\n");
-                return 1;
-            }
+        off = buffer = malloc(size + 1);
+        ind = opt->ind;
 
-            break;
+        while (ind < argc) {
+            if (ind > opt->ind) {
+                strcpy(off++, " ");
+            }
+            strcpy(off, opt->argv[ind]);
+            off += strlen(opt->argv[ind]);
+            ind++;
         }
-        case OPT_DECODE_BASE32HEX: {
 
-            result = apr_pdecode_base32(pool, result, size, APR_ENCODE_BASE32HEX, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base32hex decode data.\n");
-                return 1;
-            }
+    } else if (!stream && rd != in
+            && APR_SUCCESS == map_source(rd, pool, &buffer, &size)) {
 
-            break;
-        }
-        case OPT_BASE16: {
+        /* transform the file where it lies */
+        mapped = 1;
 
-            result = apr_pencode_base16(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base16 encode data.\n");
-                return 1;
-            }
+    } else if (stream || records) {
 
-            break;
+        /* read as we go, one chunk at a time */
+        if (!stream) {
+            chunk = ENDEC_CHUNK_SIZE;
         }
-        case OPT_BASE16COLON: {
+        buffer = malloc(chunk + 1);
+        chunked = 1;
 
-            result = apr_pencode_base16(pool, result, size, APR_ENCODE_COLON, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base16 encode data separated with colons.\n");
-                return 1;
-            }
+    } else {
+        char *off;
+        apr_size_t len = 1024;
 
-            break;
-        }
-        case OPT_BASE16LOWER: {
+        off = buffer = malloc(len);
 
-            result = apr_pencode_base16(pool, result, size, APR_ENCODE_LOWER, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base16 encode data in lower case.\n");
-                return 1;
-            }
+        while (APR_SUCCESS
+                == (status = apr_file_read_full(rd, off, len - (off - buffer) - 1,
+                        &l))) {
 
-            break;
-        }
-        case OPT_BASE16COLONLOWER: {
+            size += l;
+            len *= 2;
 
-            result = apr_pencode_base16(pool, result, size, APR_ENCODE_COLON | APR_ENCODE_LOWER, &size);
-            if (!result) {
-                apr_file_printf(err,
-                        "Could not base16 encode data separated with colons in lower case.\n");
+            buffer = realloc(buffer, len);
+            if (!buffer) {
                 return 1;
             }
 
-            break;
+            off = buffer + size;
         }
-        case OPT_DECODE_BASE16: {
 
-            result = apr_pdecode_base16(pool, result, size, APR_ENCODE_NONE, &size);
-            if (!result) {
+        size += l;
+
+        buffer[size] = 0;
+
+    }
+
+    /* chunks are measured as they are read */
+    if (!chunked) {
+        endec_stats_end(chain->rstats, size, 0);
+    }
+
+    if (!mapped) {
+        apr_pool_cleanup_register(pool, buffer, cleanup_buffer, cleanup_buffer);
+    }
+
+    /* apply the transformations, writing the destination */
+    if (chunked && pipeline) {
+        apr_status_t rdstatus;
+
+        status = endec_chain_pipeline(chain, rd, chunk, &rdstatus);
+        if (rdstatus != APR_SUCCESS) {
+            apr_file_printf(err,
+                    "Could not read: %pm\n", &rdstatus);
+            return 1;
+        }
+    }
+    else if (chunked) {
+        int eos;
+
+        do {
+            l = chunk;
+            endec_stats_begin(chain->rstats);
+            status = apr_file_read(rd, buffer, &l);
+            endec_stats_end(chain->rstats, l, 0);
+            if (APR_SUCCESS != status && APR_EOF != status) {
                 apr_file_printf(err,
-                        "Could not base16 decode data, bad characters encountered.\n");
+                        "Could not read: %pm\n", &status);
                 return 1;
             }
+            eos = (APR_EOF == status);
 
-            break;
-        }
-        }
+            status = endec_chain_write(chain, buffer, l, eos);
+        } while (APR_SUCCESS == status && !eos);
 
     }
+    else {
+        status = endec_chain_write(chain, buffer, size, 1);
+    }
 
-    /* write the destination */
-    status = apr_file_write_full(wr, result, size, &l);
+    if (stats) {
+        stats_report(err, stats == 2, chain, cmdline_opts);
+    }
+
+    if (chain->failed) {
+        apr_file_printf(err, "%s", chain->failed->error);
+        return 1;
+    }
     if (status != APR_SUCCESS) {
         apr_file_printf(err,
                 "Could not write: %pm\n", &status);
         return 1;
     }
 
+    if (length) {
+        apr_file_printf(wr, "%" APR_UINT64_T_FMT "\n", chain->total);
+    }
+
     return 0;
 }
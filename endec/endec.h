@@ -0,0 +1,651 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - definitions shared between the parts of the endec tool
+ *
+ */
+
+#ifndef ENDEC_H
+#define ENDEC_H
+
+#include <time.h>
+
+#include <apr.h>
+#include <apr_file_io.h>
+#include <apr_getopt.h>
+#include <apr_pools.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#if APR_HAS_THREADS
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_pool.h>
+#endif
+
+#define OPT_URL 'u'
+#define OPT_DECODE_URL 'U'
+#define OPT_FORM 'f'
+#define OPT_DECODE_FORM 'F'
+#define OPT_PATH 'p'
+#define OPT_ENTITY 'e'
+#define OPT_DECODE_ENTITY 'E'
+#define OPT_ECHO 'c'
+#define OPT_ECHOQUOTE 244
+#define OPT_LDAP 'l'
+#define OPT_LDAP_DN 245
+#define OPT_LDAP_FILTER 246
+#define OPT_BASE64 'b'
+#define OPT_BASE64URL 247
+#define OPT_BASE64URL_NOPAD 248
+#define OPT_DECODE_BASE64 'B'
+#define OPT_BASE32 't'
+#define OPT_BASE32HEX 249
+#define OPT_BASE32HEX_NOPAD 250
+#define OPT_DECODE_BASE32 'T'
+#define OPT_DECODE_BASE32HEX 251
+#define OPT_BASE16 's'
+#define OPT_BASE16COLON 254
+#define OPT_BASE16LOWER 253
+#define OPT_BASE16COLONLOWER 252
+#define OPT_DECODE_BASE16 'S'
+#define OPT_STREAM 243
+#define OPT_THREADS 242
+#define OPT_RECORDS 241
+#define OPT_NULL 240
+#define OPT_SERVE 239
+#define OPT_PIPELINE 238
+#define OPT_STATS 237
+#define OPT_STATS_JSON 236
+#define OPT_CHECK 235
+#define OPT_LENGTH 234
+#define OPT_BATCH 233
+#define OPT_SUFFIX 232
+#define OPT_TEE 231
+#define OPT_BASE64_WRAP 230
+#define OPT_DECODE_BASE64_WRAPPED 229
+#define OPT_BASE85 228
+#define OPT_DECODE_BASE85 227
+#define OPT_Z85 226
+#define OPT_DECODE_Z85 225
+#define OPT_ASCII85 224
+#define OPT_DECODE_ASCII85 223
+#define OPT_JSON 222
+#define OPT_DECODE_JSON 221
+#define OPT_UTF8_VALIDATE 220
+#define OPT_SHA256 219
+#define OPT_SHA1 218
+#define OPT_MD5 217
+
+/* size of the chunks read and passed between stages when streaming */
+#define ENDEC_CHUNK_SIZE (64 * 1024)
+
+/* smallest piece of input worth handing to another thread */
+#define ENDEC_PIECE_SIZE (256 * 1024)
+
+/* suffix added to the name of each file transformed with --batch */
+#define ENDEC_BATCH_SUFFIX ".out"
+
+/* check each file with --batch, or give the size of each result */
+#define ENDEC_BATCH_CHECK 0x01
+#define ENDEC_BATCH_LENGTH 0x02
+
+/* fix the layout of base16 data, rather than recognise it */
+#define ENDEC_BASE16_PLAIN 0x10000
+#define ENDEC_BASE16_COLON 0x20000
+
+/* pick the Z85 or Ascii85 alphabet rather than that of RFC 1924 */
+#define ENDEC_BASE85_Z85 0x40000
+#define ENDEC_BASE85_ASCII85 0x80000
+
+/* vector kernels are available on x86 with gcc or clang */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENDEC_X86 1
+#else
+#define ENDEC_X86 0
+#endif
+
+/* CPU features used to pick kernels */
+#define ENDEC_CPU_SSE41 0x01
+#define ENDEC_CPU_AVX2 0x02
+#define ENDEC_CPU_AVX512 0x04
+#define ENDEC_CPU_SHA 0x08
+
+typedef struct endec_stage_t endec_stage_t;
+typedef struct endec_chain_t endec_chain_t;
+
+/*
+ * An encoder or decoder with the same signature as apr_encode_base64().
+ */
+typedef apr_status_t (*endec_codec_fn)(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Transform the input, returning the result in out / outlen.
+ *
+ * A stage consumes as much of the input as it can without splitting a
+ * block or an escape sequence, and reports how much it used in consumed.
+ * Whatever is left over is handed back to the stage at the front of the
+ * next call. When eos is set no further input will follow, and all of
+ * the input must be consumed.
+ *
+ * The output remains valid until the next call to the same stage.
+ */
+typedef apr_status_t (*endec_transform_fn)(endec_stage_t *stage,
+        const char *in, apr_size_t inlen, int eos,
+        const char **out, apr_size_t *outlen, apr_size_t *consumed);
+
+/*
+ * A set of bytes, as a table for scalar code and as rows of bits looked
+ * up by the low nibble for the vector kernels. The bits of lo are for
+ * the bytes with the high nibble from 0 to 7, and the bits of hi for the
+ * high nibble from 8 to 15.
+ */
+typedef struct endec_class_t {
+    unsigned char member[256];
+    unsigned char lo[16];
+    unsigned char hi[16];
+} endec_class_t;
+
+/* the longest entity name understood by apr_unescape_entity() */
+#define ENDEC_ENTITY_MAX 6
+
+/* the longest message a stage builds to describe invalid data */
+#define ENDEC_MESSAGE_MAX 128
+
+/* the longest replacement an escape writes for one byte */
+#define ENDEC_REPLACE_MAX 8
+
+/*
+ * What each byte of a class is written as, by an escape that acts on
+ * each byte alone.
+ */
+typedef struct endec_replace_t {
+    unsigned char len[256];
+    char with[256][ENDEC_REPLACE_MAX];
+} endec_replace_t;
+
+/*
+ * Return the largest output that inlen bytes of input can produce. Every
+ * stage writes to the stage output buffer, sized by its bound.
+ */
+typedef apr_size_t (*endec_bound_fn)(endec_stage_t *stage, apr_size_t inlen);
+
+/*
+ * Time and bytes spent in a stage, or in reading or writing, gathered
+ * with --stats. The CPU time is that of the whole process.
+ */
+typedef struct endec_stats_t {
+    apr_uint64_t calls;
+    apr_uint64_t in;
+    apr_uint64_t out;
+    apr_interval_time_t wall;
+    clock_t cpu;
+    /* when the call being measured began */
+    apr_time_t wall_start;
+    clock_t cpu_start;
+} endec_stats_t;
+
+struct endec_stage_t {
+    /* the chain the stage belongs to */
+    endec_chain_t *chain;
+    /* the next stage in the chain, or NULL to write the result */
+    endec_stage_t *next;
+    /* message reported when the stage is given invalid data */
+    const char *error;
+    endec_transform_fn transform;
+    endec_bound_fn bound;
+    /* an encoder run in the same pass as this decoder, holding its state */
+    endec_stage_t *fused;
+    int opt;
+    int flags;
+    /* stream state carried from one chunk to the next */
+    int state;
+    /* the bytes an escape stage must act on, any others pass unchanged */
+    endec_class_t special;
+    /* what the special bytes are written as, for the table driven escapes */
+    endec_replace_t *replace;
+    /* unconsumed input carried over from the previous call */
+    char *buf;
+    apr_size_t len;
+    apr_size_t size;
+    /* output buffer, sized by bound, or lent by the chain */
+    char *out;
+    apr_size_t outsize;
+    /* the input with the whitespace taken out, for a wrapped decoder */
+    char *strip;
+    apr_size_t stripsize;
+    /* the length of the lines an encoder breaks its output into, if any */
+    apr_size_t wrap;
+    /* the input passed on so far, and the message built on failure */
+    apr_uint64_t seen;
+    char *message;
+    /* the digest of the input so far, for a digest stage */
+    void *digest;
+    /* time and bytes spent, if asked for */
+    endec_stats_t *stats;
+    /* the last stage of a counting chain, which only works out its size */
+    int discard;
+};
+
+/*
+ * A piece of the input to one stage, handled by one thread.
+ */
+typedef struct endec_piece_t {
+    endec_chain_t *chain;
+    endec_codec_fn codec;
+    int flags;
+    const char *in;
+    apr_size_t inlen;
+    char *out;
+    apr_size_t outlen;
+    /* where the output lies in the stage output buffer */
+    apr_size_t off;
+    /* a separator comes before the output */
+    int sep;
+    apr_status_t status;
+} endec_piece_t;
+
+struct endec_chain_t {
+    apr_pool_t *pool;
+    endec_stage_t *first;
+    endec_stage_t *last;
+    /* where the result is written */
+    apr_file_t *wr;
+    /* the largest piece of input handed to a stage in one call */
+    apr_size_t chunk;
+    /* the stage that rejected the data, if any */
+    endec_stage_t *failed;
+    /* output buffers taken in turn by the stages, when passed data whole */
+    char *turn[2];
+    apr_size_t turnsize[2];
+    /* each record is transformed on its own, ended by delim */
+    int records;
+    char delim;
+    /* partial record carried over from the previous call */
+    char *rec;
+    apr_size_t reclen;
+    apr_size_t recsize;
+    /* output gathered into larger writes, or captured */
+    int capture;
+    char *obuf;
+    apr_size_t olen;
+    apr_size_t osize;
+    /* the number of threads sharing the work, if more than one */
+    int threads;
+    /* time and bytes spent reading and writing, if asked for */
+    endec_stats_t *rstats;
+    endec_stats_t *wstats;
+    /* the result is counted in total rather than written */
+    int count;
+    apr_uint64_t total;
+    /* chains given the result rather than it being written, if any */
+    apr_array_header_t *branches;
+#if APR_HAS_THREADS
+    apr_thread_pool_t *tp;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    endec_piece_t *pieces;
+    /* pieces not yet finished */
+    int pending;
+#endif
+};
+
+/*
+ * Create a stage for the given option, or return NULL if the option is
+ * not a transformation.
+ */
+endec_stage_t *endec_stage_make(apr_pool_t *pool, int opt);
+
+/*
+ * Break the output of a base64 or base64url encoder into lines of width
+ * characters, each ended with a newline. A width of zero leaves the
+ * output unbroken. Returns APR_EINVAL for any other stage. Call before
+ * the stage is added to a chain.
+ */
+apr_status_t endec_stage_wrap(endec_stage_t *stage, apr_size_t width);
+
+/*
+ * Create an empty chain writing to wr. Input is passed to each stage in
+ * pieces of at most chunk bytes.
+ */
+endec_chain_t *endec_chain_make(apr_pool_t *pool, apr_file_t *wr,
+        apr_size_t chunk);
+
+/*
+ * Add a stage to the end of the chain. An encoder that follows a decoder
+ * it can share a pass with is joined onto the decoder.
+ */
+void endec_chain_add(endec_chain_t *chain, endec_stage_t *stage);
+
+/*
+ * Share the base64, base32 and base16 work of the chain between the given
+ * number of threads, including the calling thread.
+ */
+apr_status_t endec_chain_threads(endec_chain_t *chain, int threads);
+
+/*
+ * Treat the data as records ended by delim, passing each record through
+ * the chain on its own and ending each result with delim.
+ */
+apr_status_t endec_chain_records(endec_chain_t *chain, char delim);
+
+/*
+ * Add a branch writing to wr. The result of the chain is passed to each
+ * branch in turn rather than being written, so that the stages shared by
+ * the branches run once. The branch shares the threads of the chain, and
+ * is made ready for its own stages to be added.
+ */
+endec_chain_t *endec_chain_tee(endec_chain_t *chain, apr_file_t *wr);
+
+/*
+ * Count the size of the result in total rather than writing it. Call
+ * before the stages are added, so that the last stage can work out the
+ * size of its output without making it where it knows how.
+ */
+void endec_chain_count(endec_chain_t *chain);
+
+/*
+ * Gather time and bytes spent in each stage of the chain, and in reading
+ * and writing. Call once the stages and any branches have been added.
+ */
+void endec_chain_stats(endec_chain_t *chain);
+
+/*
+ * Start measuring a call, if stats is not NULL.
+ */
+void endec_stats_begin(endec_stats_t *stats);
+
+/*
+ * Finish measuring a call that took in bytes and gave out bytes, if stats
+ * is not NULL.
+ */
+void endec_stats_end(endec_stats_t *stats, apr_size_t in, apr_size_t out);
+
+/*
+ * Gather the output in obuf / olen rather than writing it. The caller
+ * collects the output, and resets the chain before the next use.
+ */
+void endec_chain_capture(endec_chain_t *chain);
+
+/*
+ * Make the chain ready to transform fresh data, forgetting any data
+ * carried over, captured output and any failure.
+ */
+void endec_chain_reset(endec_chain_t *chain);
+
+/*
+ * Pass data through the chain, writing any output that results. Set eos
+ * on the final call to flush the chain.
+ *
+ * If a stage rejects the data, chain->failed is set to that stage.
+ */
+apr_status_t endec_chain_write(endec_chain_t *chain, const char *data,
+        apr_size_t len, int eos);
+
+/*
+ * Stream the data read from rd through the chain, with the reading and
+ * the writing each done on a thread of its own. Chunks of up to chunk
+ * bytes are read. A failure to read is given back in rdstatus. If the
+ * chain fails, a read under way is finished before the call returns.
+ */
+apr_status_t endec_chain_pipeline(endec_chain_t *chain, apr_file_t *rd,
+        apr_size_t chunk, apr_status_t *rdstatus);
+
+/*
+ * Make sure the buffer at buf, allocated with malloc(), can hold size
+ * bytes, plus a spare byte so that even an empty buffer is allocated.
+ */
+apr_status_t endec_reserve(char **buf, apr_size_t *bufsize,
+        apr_size_t size);
+
+/*
+ * Answer framed requests read from rd until the caller goes away, each
+ * naming the transformations to apply with the given options. Returns
+ * the exit code.
+ */
+int endec_serve(apr_pool_t *pool, apr_file_t *rd, apr_file_t *wr,
+        apr_file_t *err, const apr_getopt_option_t *opts);
+
+/*
+ * Transform each regular file below the directory rdpath, or each file
+ * named one per line in rdpath or rd when rdpath is not a directory,
+ * with the given stages, sharing the files between the given number of
+ * threads. Each result is written to the name of the file with suffix
+ * added. Failures are reported for each file. Returns the exit code.
+ */
+int endec_batch(apr_pool_t *pool, apr_file_t *rd, const char *rdpath,
+        apr_file_t *wr, apr_file_t *err, apr_array_header_t *stages,
+        const char *suffix, int threads, int flags);
+
+/*
+ * Detect the CPU and pick the fastest kernels it supports.
+ */
+void endec_kernels_init(void);
+
+/*
+ * Pick the base64 kernels for the given ENDEC_CPU_* features.
+ */
+void endec_base64_init(int cpu);
+
+/*
+ * Encode as base64, or base64url with APR_ENCODE_URL. Padding is added
+ * unless APR_ENCODE_NOPADDING is set. The output is identical to
+ * apr_encode_base64(), but is not NUL terminated.
+ */
+apr_status_t endec_encode_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base64 or base64url, optionally followed by padding, as
+ * apr_decode_base64() does. Returns APR_BADCH on invalid data. The
+ * destination must have room for slen bytes.
+ */
+apr_status_t endec_decode_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Pick the base32 kernels for the given ENDEC_CPU_* features.
+ */
+void endec_base32_init(int cpu);
+
+/*
+ * Encode as base32, or base32hex with APR_ENCODE_BASE32HEX. Padding is
+ * added unless APR_ENCODE_NOPADDING is set. The output is identical to
+ * apr_encode_base32(), but is not NUL terminated.
+ */
+apr_status_t endec_encode_base32(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base32, or base32hex with APR_ENCODE_BASE32HEX, optionally
+ * followed by padding, as apr_decode_base32() does. Returns APR_BADCH on
+ * invalid data. The destination must have room for slen bytes.
+ */
+apr_status_t endec_decode_base32(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Pick the base16 kernels for the given ENDEC_CPU_* features.
+ */
+void endec_base16_init(int cpu);
+
+/*
+ * Encode as base16, in lower case with APR_ENCODE_LOWER, and with each
+ * byte separated by a colon with APR_ENCODE_COLON. The output is
+ * identical to apr_encode_base16(), but is not NUL terminated.
+ */
+apr_status_t endec_encode_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base16 in either case, with or without colons, as
+ * apr_decode_base16() does. Colons are recognised by the first separator,
+ * unless ENDEC_BASE16_PLAIN or ENDEC_BASE16_COLON is set. Returns
+ * APR_BADCH on invalid data. The destination must have room for slen
+ * bytes.
+ */
+apr_status_t endec_decode_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base64 and encode the result as base16 with the given flags, in
+ * one pass. The output is identical to endec_decode_base64() followed by
+ * endec_encode_base16().
+ */
+apr_status_t endec_base64_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base64 and encode the result as base64 with the given flags, in
+ * one pass. The output is identical to endec_decode_base64() followed by
+ * endec_encode_base64().
+ */
+apr_status_t endec_base64_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base16 laid out as given by ENDEC_BASE16_PLAIN or
+ * ENDEC_BASE16_COLON, and encode the result as base64 with the remaining
+ * flags, in one pass. The output is identical to endec_decode_base16()
+ * followed by endec_encode_base64().
+ */
+apr_status_t endec_base16_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Pick the base85 kernels for the given ENDEC_CPU_* features, and build
+ * the alphabets.
+ */
+void endec_base85_init(int cpu);
+
+/*
+ * Encode as base85 with the alphabet of RFC 1924, or as Z85 with
+ * ENDEC_BASE85_Z85, or as Ascii85 with ENDEC_BASE85_ASCII85, where a block
+ * of zeros is written as 'z'. A final block of n bytes is written as n + 1
+ * characters. The output is not NUL terminated.
+ */
+apr_status_t endec_encode_base85(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Decode base85, Z85 or Ascii85 as picked by the flags. Returns APR_BADCH
+ * on invalid data, including a block too large for four bytes. The
+ * destination must have room for slen bytes, and for three more for each
+ * 'z' in Ascii85.
+ */
+apr_status_t endec_decode_base85(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len);
+
+/*
+ * Pick the escape kernels for the given ENDEC_CPU_* features.
+ */
+void endec_escape_init(int cpu);
+
+/*
+ * Add a byte to the class.
+ */
+void endec_class_add(endec_class_t *cls, unsigned char c);
+
+/*
+ * Return the length of the run of bytes at the start of src that are not
+ * in the class.
+ */
+apr_size_t endec_class_span(const endec_class_t *cls, const char *src,
+        apr_size_t len);
+
+/*
+ * Copy src to dest, writing each byte in the class as given by rep.
+ * Returns the length written.
+ */
+apr_size_t endec_replace(const endec_class_t *cls,
+        const endec_replace_t *rep, char *dest, const char *src,
+        apr_size_t slen);
+
+/*
+ * Decode "%XX" escapes, and '+' as a space if '+' is in the class, as
+ * apr_unescape_url() does. The class holds the bytes that start an
+ * escape. Unlike APR, "%00" and a NUL in the data both give a NUL.
+ * Returns APR_BADCH on an escape that is not followed by two hex digits.
+ * The destination must have room for slen bytes.
+ */
+apr_status_t endec_unescape_percent(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, apr_size_t *len);
+
+/*
+ * Decode numeric entities and the named entities known to APR, as
+ * apr_unescape_entity() does, including dropping numeric entities that
+ * are not printable. The class holds '&'. Unlike APR, a NUL in the data
+ * is kept. Returns APR_NOTFOUND if no entity was decoded. The
+ * destination must have room for slen bytes.
+ */
+apr_status_t endec_unescape_entity(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, apr_size_t *len);
+
+/*
+ * Decode the escapes of a JSON string, including "\uXXXX" escapes and
+ * surrogate pairs, which are written as UTF-8. The class holds '\'.
+ * Other bytes are passed unchanged. When partial is set, an escape cut
+ * short by the end of the data is left undecoded, and the length of the
+ * data decoded is given in used. Returns APR_BADCH on an invalid escape,
+ * or a surrogate that is not paired. The destination must have room for
+ * slen bytes.
+ */
+apr_status_t endec_unescape_json(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, int partial, apr_size_t *used,
+        apr_size_t *len);
+
+/*
+ * Pick the UTF-8 validation kernels for the given ENDEC_CPU_* features.
+ */
+void endec_utf8_init(int cpu);
+
+/*
+ * Return the length of the valid UTF-8 at the start of src, made of
+ * whole characters, rejecting overlong forms, surrogates and code points
+ * past U+10FFFF. When the rest is the start of a valid character cut
+ * short by the end of the data, cut is set.
+ */
+apr_size_t endec_utf8_valid(const char *src, apr_size_t slen, int *cut);
+
+#define ENDEC_SHA256_DIGESTSIZE 32
+
+/*
+ * A SHA-256 digest in progress.
+ */
+typedef struct endec_sha256_t {
+    apr_uint32_t state[8];
+    apr_uint64_t count;
+    unsigned char buf[64];
+} endec_sha256_t;
+
+/*
+ * Pick the SHA-256 kernel for the given ENDEC_CPU_* features.
+ */
+void endec_sha256_init(int cpu);
+
+/*
+ * Start, add data to, and finish a SHA-256 digest, in the manner of
+ * apr_sha1_init(), apr_sha1_update_binary() and apr_sha1_final().
+ */
+void endec_sha256_start(endec_sha256_t *ctx);
+void endec_sha256_update(endec_sha256_t *ctx, const char *src,
+        apr_size_t slen);
+void endec_sha256_final(unsigned char *digest, endec_sha256_t *ctx);
+
+#endif
@@ -0,0 +1,643 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - escape kernels
+ *
+ * A class of bytes is looked up a nibble at a time, so that the vector
+ * kernels can test any set of bytes sixteen or thirty two at a time. The
+ * low nibble picks a row of bits from the lookup, and the high nibble
+ * picks the bit within the row.
+ *
+ * Escaping copies each run of bytes outside the class as it is, and
+ * replaces the bytes within it from a table. Percent unescaping copies
+ * each run up to the next '%' or '+', and decodes a run of escapes five
+ * at a time where it can. Entity unescaping copies each run up to the
+ * next '&', and looks names up in a perfect hash.
+ */
+
+#include <string.h>
+
+#include <apr.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+typedef apr_size_t (*span_fn)(const endec_class_t *cls,
+        const unsigned char *in, apr_size_t len);
+
+static apr_size_t span_scalar(const endec_class_t *cls,
+        const unsigned char *in, apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 0; i < len && !cls->member[in[i]]; i++);
+
+    return i;
+}
+
+#if ENDEC_X86
+
+__attribute__((target("sse4.1")))
+static apr_size_t span_sse41(const endec_class_t *cls,
+        const unsigned char *in, apr_size_t len)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)cls->lo);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)cls->hi);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i seven = _mm_set1_epi8(7);
+    const __m128i zero = _mm_setzero_si128();
+    apr_size_t i;
+
+    for (i = 0; len - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i l = _mm_and_si128(v, nibble);
+        __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i row = _mm_blendv_epi8(_mm_shuffle_epi8(lo, l),
+                _mm_shuffle_epi8(hi, l), _mm_cmpgt_epi8(h, seven));
+        __m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bits, h));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, zero));
+
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t span_avx2(const endec_class_t *cls,
+        const unsigned char *in, apr_size_t len)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)cls->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)cls->hi));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i seven = _mm256_set1_epi8(7);
+    const __m256i zero = _mm256_setzero_si256();
+    apr_size_t i;
+
+    for (i = 0; len - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i l = _mm256_and_si256(v, nibble);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo, l),
+                _mm256_shuffle_epi8(hi, l), _mm256_cmpgt_epi8(h, seven));
+        __m256i hit = _mm256_and_si256(row, _mm256_shuffle_epi8(bits, h));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, zero));
+
+        if (mask != 0xffffffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+
+    return i;
+}
+
+/*
+ * Turn sixteen hex digits into their values, with valid set to all ones
+ * for each byte that was a hex digit.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i unhex_sse41(__m128i in, __m128i *valid)
+{
+    __m128i digit, letter, folded;
+
+    digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+    folded = _mm_or_si128(in, _mm_set1_epi8(0x20));
+    letter = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(folded, _mm_set1_epi8('f' + 1)));
+
+    *valid = _mm_or_si128(digit, letter);
+
+    return _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(in, _mm_set1_epi8('0'))),
+            _mm_and_si128(letter, _mm_sub_epi8(folded,
+            _mm_set1_epi8('a' - 10))));
+}
+
+/*
+ * Decode escapes five at a time, for as long as sixteen bytes start with
+ * five valid escapes in a row. Returns the number of escapes decoded,
+ * leaving anything else to the caller.
+ */
+__attribute__((target("sse4.1")))
+static apr_size_t unescape_sse41(unsigned char *dest,
+        const unsigned char *src, apr_size_t slen)
+{
+    /* the digit pairs, padded out with a digit already checked */
+    const __m128i pairs = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11,
+            13, 14, 1, 2, 1, 2, 1, 2);
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    const __m128i percent = _mm_set1_epi8('%');
+    apr_size_t i, n = 0;
+
+    for (i = 0; slen - i >= 16; i += 15, n += 5) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i digits, valid;
+
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, percent)) & 0x1249)
+                != 0x1249) {
+            break;
+        }
+
+        digits = unhex_sse41(_mm_shuffle_epi8(v, pairs), &valid);
+        if (_mm_movemask_epi8(valid) != 0xffff) {
+            break;
+        }
+
+        /* the first five bytes are the result, the rest are overwritten */
+        _mm_storel_epi64((__m128i *)(dest + n), _mm_packus_epi16(
+                _mm_maddubs_epi16(digits, weights), _mm_setzero_si128()));
+    }
+
+    return n;
+}
+
+#endif
+
+static span_fn span_bulk = span_scalar;
+
+/* the bytes that end the search for the end of an entity */
+static endec_class_t entity_end;
+
+static apr_size_t unescape_none(unsigned char *dest,
+        const unsigned char *src, apr_size_t slen)
+{
+    return 0;
+}
+
+static apr_size_t (*unescape_bulk)(unsigned char *dest,
+        const unsigned char *src, apr_size_t slen) = unescape_none;
+
+void endec_escape_init(int cpu)
+{
+    endec_class_add(&entity_end, ';');
+    endec_class_add(&entity_end, 0);
+
+    span_bulk = span_scalar;
+    unescape_bulk = unescape_none;
+
+#if ENDEC_X86
+    if (cpu & ENDEC_CPU_AVX2) {
+        span_bulk = span_avx2;
+    }
+    else if (cpu & ENDEC_CPU_SSE41) {
+        span_bulk = span_sse41;
+    }
+    if (cpu & (ENDEC_CPU_AVX2 | ENDEC_CPU_SSE41)) {
+        unescape_bulk = unescape_sse41;
+    }
+#endif
+}
+
+void endec_class_add(endec_class_t *cls, unsigned char c)
+{
+    cls->member[c] = 1;
+
+    if (c < 0x80) {
+        cls->lo[c & 0x0f] |= 1 << (c >> 4);
+    }
+    else {
+        cls->hi[c & 0x0f] |= 1 << ((c >> 4) & 7);
+    }
+}
+
+apr_size_t endec_class_span(const endec_class_t *cls, const char *src,
+        apr_size_t len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    apr_size_t i;
+
+    i = span_bulk(cls, in, len);
+
+    return i + span_scalar(cls, in + i, len - i);
+}
+
+apr_size_t endec_replace(const endec_class_t *cls,
+        const endec_replace_t *rep, char *dest, const char *src,
+        apr_size_t slen)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + slen;
+    char *out = dest;
+    apr_size_t n;
+
+    while (in < end) {
+
+        if (cls->member[*in]) {
+            memcpy(out, rep->with[*in], rep->len[*in]);
+            out += rep->len[*in];
+            in++;
+            continue;
+        }
+
+        n = endec_class_span(cls, (const char *)in, end - in);
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+    }
+
+    return out - dest;
+}
+
+static int unhex(unsigned char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+apr_status_t endec_unescape_percent(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + slen;
+    unsigned char *out = (unsigned char *)dest;
+    apr_size_t n;
+    int hi, lo;
+
+    while (in < end) {
+
+        n = endec_class_span(cls, (const char *)in, end - in);
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+
+        if (in == end) {
+            break;
+        }
+
+        if (*in == '+') {
+            *out++ = ' ';
+            in++;
+            continue;
+        }
+
+        n = unescape_bulk(out, in, end - in);
+        if (n) {
+            out += n;
+            in += 3 * n;
+            continue;
+        }
+
+        if (end - in < 3 || (hi = unhex(in[1])) < 0
+                || (lo = unhex(in[2])) < 0) {
+            return APR_BADCH;
+        }
+
+        *out++ = hi << 4 | lo;
+        in += 3;
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The entity names known to apr_unescape_entity(), placed by the hash in
+ * entity_find() so that no two names share a slot.
+ */
+typedef struct entity_t {
+    char name[ENDEC_ENTITY_MAX + 1];
+    unsigned char len;
+    unsigned char c;
+} entity_t;
+
+static const entity_t entities[256] = {
+    [1] = { "ccedil", 6, 0xe7 },
+    [9] = { "ntilde", 6, 0xf1 },
+    [14] = { "Atilde", 6, 0xc3 },
+    [15] = { "iacute", 6, 0xed },
+    [19] = { "Eacute", 6, 0xc9 },
+    [22] = { "igrave", 6, 0xec },
+    [26] = { "Egrave", 6, 0xc8 },
+    [31] = { "iuml", 4, 0xef },
+    [32] = { "ucirc", 5, 0xfb },
+    [35] = { "Euml", 4, 0xcb },
+    [38] = { "otilde", 6, 0xf5 },
+    [44] = { "aacute", 6, 0xe1 },
+    [46] = { "Oacute", 6, 0xd3 },
+    [52] = { "agrave", 6, 0xe0 },
+    [54] = { "Ograve", 6, 0xd2 },
+    [58] = { "aring", 5, 0xe5 },
+    [60] = { "auml", 4, 0xe4 },
+    [62] = { "Ouml", 4, 0xd6 },
+    [65] = { "Icirc", 5, 0xce },
+    [71] = { "eth", 3, 0xf0 },
+    [74] = { "Yacute", 6, 0xdd },
+    [90] = { "ecirc", 5, 0xea },
+    [94] = { "Acirc", 5, 0xc2 },
+    [99] = { "uacute", 6, 0xfa },
+    [106] = { "ugrave", 6, 0xf9 },
+    [108] = { "gt", 2, 0x3e },
+    [115] = { "uuml", 4, 0xfc },
+    [117] = { "ocirc", 5, 0xf4 },
+    [118] = { "Ccedil", 6, 0xc7 },
+    [120] = { "AElig", 5, 0xc6 },
+    [126] = { "Ntilde", 6, 0xd1 },
+    [127] = { "oslash", 6, 0xf8 },
+    [128] = { "quot", 4, 0x22 },
+    [132] = { "Iacute", 6, 0xcd },
+    [139] = { "THORN", 5, 0xde },
+    [140] = { "Igrave", 6, 0xcc },
+    [148] = { "Iuml", 4, 0xcf },
+    [149] = { "Ucirc", 5, 0xdb },
+    [153] = { "atilde", 6, 0xe3 },
+    [155] = { "Otilde", 6, 0xd5 },
+    [158] = { "eacute", 6, 0xe9 },
+    [161] = { "Aacute", 6, 0xc1 },
+    [165] = { "egrave", 6, 0xe8 },
+    [169] = { "Agrave", 6, 0xc0 },
+    [174] = { "euml", 4, 0xeb },
+    [176] = { "Aring", 5, 0xc5 },
+    [177] = { "Auml", 4, 0xc4 },
+    [185] = { "oacute", 6, 0xf3 },
+    [192] = { "ograve", 6, 0xf2 },
+    [201] = { "ouml", 4, 0xf6 },
+    [203] = { "icirc", 5, 0xee },
+    [207] = { "Ecirc", 5, 0xca },
+    [212] = { "yacute", 6, 0xfd },
+    [213] = { "aelig", 5, 0xe6 },
+    [216] = { "Uacute", 6, 0xda },
+    [224] = { "Ugrave", 6, 0xd9 },
+    [226] = { "thorn", 5, 0xfe },
+    [228] = { "yuml", 4, 0xff },
+    [232] = { "Uuml", 4, 0xdc },
+    [233] = { "acirc", 5, 0xe2 },
+    [235] = { "Ocirc", 5, 0xd4 },
+    [237] = { "szlig", 5, 0xdf },
+    [240] = { "ETH", 3, 0xd0 },
+    [244] = { "Oslash", 6, 0xd8 },
+    [246] = { "amp", 3, 0x26 },
+    [250] = { "lt", 2, 0x3c },
+};
+
+static const entity_t *entity_find(const unsigned char *name, apr_size_t len)
+{
+    const entity_t *e;
+    apr_uint32_t key;
+
+    if (len < 2 || len > ENDEC_ENTITY_MAX) {
+        return NULL;
+    }
+
+    key = name[0] | name[1] << 8 | (apr_uint32_t)name[len - 1] << 16
+            | (apr_uint32_t)len << 24;
+
+    e = &entities[(apr_uint32_t)(key * 0x1c568fd1U) >> 24];
+    if (e->len != len || memcmp(e->name, name, len)) {
+        return NULL;
+    }
+
+    return e;
+}
+
+apr_status_t endec_unescape_entity(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + slen;
+    const unsigned char *semi = in;
+    unsigned char *out = (unsigned char *)dest;
+    const entity_t *e;
+    apr_uint32_t val;
+    apr_size_t n, i, j;
+    int found = 0, v;
+
+    while (in < end) {
+
+        n = endec_class_span(cls, (const char *)in, end - in);
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+
+        if (in == end) {
+            break;
+        }
+
+        /* an entity runs to the next semicolon, found once for many '&' */
+        if (semi <= in) {
+            semi = in + 1 + endec_class_span(&entity_end,
+                    (const char *)in + 1, end - in - 1);
+        }
+
+        /* without a semicolon, the '&' is only data */
+        if (semi == end || !*semi) {
+            *out++ = *in++;
+            continue;
+        }
+
+        i = semi - in;
+
+        if (in[1] == '#') {
+
+            /* wraps as the int in APR does */
+            for (j = 2, val = 0; j < i && in[j] >= '0' && in[j] <= '9'; j++) {
+                val = val * 10 + in[j] - '0';
+            }
+
+            in = semi + 1;
+            v = (int)val;
+
+            /* anything but a printable byte vanishes */
+            if (j < i || v <= 8 || (v >= 11 && v <= 31)
+                    || (v >= 127 && v <= 160) || v >= 256) {
+                continue;
+            }
+
+            *out++ = v;
+            found = 1;
+            continue;
+        }
+
+        e = entity_find(in + 1, i - 1);
+        if (!e) {
+            *out++ = *in++;
+            continue;
+        }
+
+        *out++ = e->c;
+        in = semi + 1;
+        found = 1;
+    }
+
+    *len = out - (unsigned char *)dest;
+
+    return found ? APR_SUCCESS : APR_NOTFOUND;
+}
+
+/* returns the value of four hex digits, or -1 */
+static long unhex4(const unsigned char *in)
+{
+    long v = 0;
+    int k, d;
+
+    for (k = 0; k < 4; k++) {
+        if ((d = unhex(in[k])) < 0) {
+            return -1;
+        }
+        v = v << 4 | d;
+    }
+
+    return v;
+}
+
+apr_status_t endec_unescape_json(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen, int partial, apr_size_t *used,
+        apr_size_t *len)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + slen;
+    unsigned char *out = (unsigned char *)dest;
+    apr_size_t n;
+    long cp, lo;
+    unsigned char c;
+
+    while (in < end) {
+
+        n = endec_class_span(cls, (const char *)in, end - in);
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            goto cut;
+        }
+
+        switch (in[1]) {
+        case '"':
+        case '\\':
+        case '/': {
+            c = in[1];
+            break;
+        }
+        case 'b': {
+            c = '\b';
+            break;
+        }
+        case 'f': {
+            c = '\f';
+            break;
+        }
+        case 'n': {
+            c = '\n';
+            break;
+        }
+        case 'r': {
+            c = '\r';
+            break;
+        }
+        case 't': {
+            c = '\t';
+            break;
+        }
+        case 'u': {
+            c = 0;
+            break;
+        }
+        default: {
+            return APR_BADCH;
+        }
+        }
+
+        if (in[1] != 'u') {
+            *out++ = c;
+            in += 2;
+            continue;
+        }
+
+        if (end - in < 6) {
+            goto cut;
+        }
+        if ((cp = unhex4(in + 2)) < 0 || (cp >= 0xdc00 && cp <= 0xdfff)) {
+            return APR_BADCH;
+        }
+        n = 6;
+
+        /* a character beyond the BMP, written as a surrogate pair */
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+            if (end - in < 12) {
+                goto cut;
+            }
+            if (in[6] != '\\' || in[7] != 'u' || (lo = unhex4(in + 8)) < 0
+                    || lo < 0xdc00 || lo > 0xdfff) {
+                return APR_BADCH;
+            }
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            n = 12;
+        }
+
+        if (cp < 0x80) {
+            *out++ = cp;
+        }
+        else if (cp < 0x800) {
+            *out++ = 0xc0 | (cp >> 6);
+            *out++ = 0x80 | (cp & 0x3f);
+        }
+        else if (cp < 0x10000) {
+            *out++ = 0xe0 | (cp >> 12);
+            *out++ = 0x80 | ((cp >> 6) & 0x3f);
+            *out++ = 0x80 | (cp & 0x3f);
+        }
+        else {
+            *out++ = 0xf0 | (cp >> 18);
+            *out++ = 0x80 | ((cp >> 12) & 0x3f);
+            *out++ = 0x80 | ((cp >> 6) & 0x3f);
+            *out++ = 0x80 | (cp & 0x3f);
+        }
+        in += n;
+    }
+
+    *used = slen;
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+
+    /* an escape cut short by the end of the data is left for next time */
+cut:
+    if (!partial) {
+        return APR_BADCH;
+    }
+
+    *used = in - (const unsigned char *)src;
+    *len = out - (unsigned char *)dest;
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,387 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - read, transform and write on threads of their own
+ *
+ * A reader thread fills chunks from the source and a writer thread
+ * drains the result, while the calling thread runs the chain. Each pair
+ * of threads is joined by a ring of slots with one producer and one
+ * consumer. Slots are handed over by counting, without a lock, and a
+ * thread only takes the lock to sleep when its ring is full or empty,
+ * or to wake the other side.
+ */
+
+#include <stdlib.h>
+
+#include <apr.h>
+#include <apr_file_io.h>
+
+#if APR_HAS_THREADS
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#endif
+
+#include "config.h"
+#include "endec.h"
+
+#if APR_HAS_THREADS
+
+/* slots in each ring, so that reading, transforming and writing overlap */
+#define RING_SLOTS 4
+
+typedef struct ring_slot_t {
+    char *data;
+    apr_size_t size;
+    apr_size_t len;
+    /* the last slot, after which no more will follow */
+    int eos;
+    apr_status_t status;
+} ring_slot_t;
+
+typedef struct ring_t {
+    ring_slot_t slots[RING_SLOTS];
+    /* slots handed over, counted only by the producer */
+    volatile apr_uint32_t head;
+    /* slots given back, counted only by the consumer */
+    volatile apr_uint32_t tail;
+    /* threads asleep on the ring */
+    volatile apr_uint32_t sleepers;
+    /* the consumer will take no more */
+    volatile apr_uint32_t closed;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+} ring_t;
+
+typedef struct pipeline_t {
+    endec_chain_t *chain;
+    apr_file_t *rd;
+    apr_size_t chunk;
+    /* chunks read, waiting to be transformed */
+    ring_t in;
+    /* results, waiting to be written */
+    ring_t out;
+    /* the first write to fail */
+    volatile apr_uint32_t failed;
+    apr_status_t wrstatus;
+} pipeline_t;
+
+/*
+ * Read a counter with a full barrier, whatever the APR version.
+ */
+static apr_uint32_t ring_read(volatile apr_uint32_t *counter)
+{
+    return apr_atomic_add32(counter, 0);
+}
+
+static int ring_can_put(ring_t *ring)
+{
+    return ring_read(&ring->head) - ring_read(&ring->tail) < RING_SLOTS
+            || ring_read(&ring->closed);
+}
+
+static int ring_can_get(ring_t *ring)
+{
+    return ring_read(&ring->head) != ring_read(&ring->tail);
+}
+
+/*
+ * Wait until ready() is true, sleeping on the ring if need be. A sleeper
+ * is counted before ready() is checked again, so that the other side
+ * either sees the sleeper or the sleeper sees its update.
+ */
+static void ring_wait(ring_t *ring, int (*ready)(ring_t *ring))
+{
+    if (ready(ring)) {
+        return;
+    }
+
+    apr_atomic_inc32(&ring->sleepers);
+
+    apr_thread_mutex_lock(ring->mutex);
+    while (!ready(ring)) {
+        apr_thread_cond_wait(ring->cond, ring->mutex);
+    }
+    apr_thread_mutex_unlock(ring->mutex);
+
+    apr_atomic_dec32(&ring->sleepers);
+}
+
+static void ring_wake(ring_t *ring)
+{
+    if (ring_read(&ring->sleepers)) {
+        apr_thread_mutex_lock(ring->mutex);
+        apr_thread_cond_broadcast(ring->cond);
+        apr_thread_mutex_unlock(ring->mutex);
+    }
+}
+
+/*
+ * Return the next slot to fill, or NULL if the consumer is gone.
+ */
+static ring_slot_t *ring_put_begin(ring_t *ring)
+{
+    ring_wait(ring, ring_can_put);
+
+    if (ring_read(&ring->closed)) {
+        return NULL;
+    }
+
+    return &ring->slots[ring->head % RING_SLOTS];
+}
+
+static void ring_put_end(ring_t *ring)
+{
+    apr_atomic_inc32(&ring->head);
+    ring_wake(ring);
+}
+
+static ring_slot_t *ring_get_begin(ring_t *ring)
+{
+    ring_wait(ring, ring_can_get);
+
+    return &ring->slots[ring->tail % RING_SLOTS];
+}
+
+static void ring_get_end(ring_t *ring)
+{
+    apr_atomic_inc32(&ring->tail);
+    ring_wake(ring);
+}
+
+/*
+ * Tell the producer that nothing more will be taken.
+ */
+static void ring_close(ring_t *ring)
+{
+    apr_atomic_inc32(&ring->closed);
+    ring_wake(ring);
+}
+
+static apr_status_t ring_make(ring_t *ring, apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if ((status = apr_thread_mutex_create(&ring->mutex,
+            APR_THREAD_MUTEX_DEFAULT, pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    return apr_thread_cond_create(&ring->cond, pool);
+}
+
+static void * APR_THREAD_FUNC pipeline_reader(apr_thread_t *thread,
+        void *data)
+{
+    pipeline_t *pl = data;
+    ring_slot_t *slot;
+    apr_status_t status;
+
+    while ((slot = ring_put_begin(&pl->in))) {
+
+        slot->len = pl->chunk;
+        endec_stats_begin(pl->chain->rstats);
+        status = apr_file_read(pl->rd, slot->data, &slot->len);
+        endec_stats_end(pl->chain->rstats, slot->len, 0);
+
+        /* the consumer may have gone while the read was under way */
+        if (ring_read(&pl->in.closed)) {
+            break;
+        }
+
+        slot->eos = (status != APR_SUCCESS);
+        slot->status = (status == APR_EOF) ? APR_SUCCESS : status;
+
+        ring_put_end(&pl->in);
+
+        if (slot->eos) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void * APR_THREAD_FUNC pipeline_writer(apr_thread_t *thread,
+        void *data)
+{
+    pipeline_t *pl = data;
+    ring_slot_t *slot;
+    apr_status_t status;
+    apr_size_t l;
+    int eos;
+
+    do {
+        slot = ring_get_begin(&pl->out);
+
+        /* after a failure, the rest is thrown away */
+        if (slot->len && !ring_read(&pl->failed)) {
+            endec_stats_begin(pl->chain->wstats);
+            status = apr_file_write_full(pl->chain->wr, slot->data,
+                    slot->len, &l);
+            endec_stats_end(pl->chain->wstats, l, 0);
+            if (status != APR_SUCCESS) {
+                pl->wrstatus = status;
+                apr_atomic_inc32(&pl->failed);
+            }
+        }
+        slot->len = 0;
+        eos = slot->eos;
+
+        ring_get_end(&pl->out);
+
+    } while (!eos);
+
+    return NULL;
+}
+
+/*
+ * Hand the result gathered so far to the writer, taking the emptied
+ * buffer of the slot in exchange.
+ */
+static void pipeline_output(pipeline_t *pl, int eos)
+{
+    endec_chain_t *chain = pl->chain;
+    ring_slot_t *slot;
+    char *data;
+    apr_size_t size;
+
+    slot = ring_put_begin(&pl->out);
+
+    data = slot->data;
+    size = slot->size;
+
+    slot->data = chain->obuf;
+    slot->size = chain->osize;
+    slot->len = chain->olen;
+    slot->eos = eos;
+
+    chain->obuf = data;
+    chain->osize = size;
+    chain->olen = 0;
+
+    ring_put_end(&pl->out);
+}
+
+static apr_status_t cleanup_pipeline(void *dummy)
+{
+    pipeline_t *pl = dummy;
+    int i;
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        free(pl->in.slots[i].data);
+        free(pl->out.slots[i].data);
+    }
+
+    return APR_SUCCESS;
+}
+
+#endif
+
+apr_status_t endec_chain_pipeline(endec_chain_t *chain, apr_file_t *rd,
+        apr_size_t chunk, apr_status_t *rdstatus)
+{
+#if APR_HAS_THREADS
+    pipeline_t *pl = apr_pcalloc(chain->pool, sizeof(pipeline_t));
+    apr_thread_t *reader, *writer;
+    apr_status_t status = APR_SUCCESS, rv;
+    ring_slot_t *slot;
+    int i, eos = 0;
+
+    *rdstatus = APR_SUCCESS;
+
+    pl->chain = chain;
+    pl->rd = rd;
+    pl->chunk = chunk;
+
+    apr_pool_cleanup_register(chain->pool, pl, cleanup_pipeline,
+            cleanup_pipeline);
+
+    for (i = 0; i < RING_SLOTS; i++) {
+        pl->in.slots[i].data = malloc(chunk + 1);
+        if (!pl->in.slots[i].data) {
+            return APR_ENOMEM;
+        }
+        pl->in.slots[i].size = chunk;
+    }
+
+    if ((status = ring_make(&pl->in, chain->pool)) != APR_SUCCESS
+            || (status = ring_make(&pl->out, chain->pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    /* the result is gathered and handed to the writer */
+    endec_chain_capture(chain);
+
+    if ((status = apr_thread_create(&writer, NULL, pipeline_writer, pl,
+            chain->pool)) != APR_SUCCESS) {
+        return status;
+    }
+    if ((status = apr_thread_create(&reader, NULL, pipeline_reader, pl,
+            chain->pool)) != APR_SUCCESS) {
+        pipeline_output(pl, 1);
+        apr_thread_join(&rv, writer);
+        return status;
+    }
+
+    while (!eos) {
+
+        slot = ring_get_begin(&pl->in);
+
+        eos = slot->eos;
+        *rdstatus = slot->status;
+        if (*rdstatus == APR_SUCCESS) {
+            status = endec_chain_write(chain, slot->data, slot->len, eos);
+        }
+
+        ring_get_end(&pl->in);
+
+        if (*rdstatus != APR_SUCCESS || status != APR_SUCCESS
+                || chain->failed || ring_read(&pl->failed)) {
+            break;
+        }
+
+        if (chain->olen && !eos) {
+            pipeline_output(pl, 0);
+        }
+    }
+
+    /* whatever was made before a failure is still written */
+    pipeline_output(pl, 1);
+    apr_thread_join(&rv, writer);
+
+    /*
+     * A reader stopped early is told to go, and is waited for, as the
+     * ring it uses belongs to the pool. A read under way is finished
+     * first.
+     */
+    if (!eos) {
+        ring_close(&pl->in);
+    }
+    apr_thread_join(&rv, reader);
+
+    if (status == APR_SUCCESS && ring_read(&pl->failed)) {
+        status = pl->wrstatus;
+    }
+
+    return status;
+#else
+    *rdstatus = APR_SUCCESS;
+
+    return APR_ENOTIMPL;
+#endif
+}
@@ -0,0 +1,324 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - answer framed requests from a long lived caller
+ *
+ * Each frame is a 32 bit length in native byte order followed by that
+ * many bytes, as written by nmbe. A request is two frames, the plan and
+ * the data. The plan holds the transformation options separated by
+ * spaces, such as "--base64-decode --entity-escape". A response is two
+ * frames, the error message and the result. The error message is empty
+ * on success, and the result is empty on failure.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_file_io.h>
+#include <apr_getopt.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+
+#include "config.h"
+#include "endec.h"
+
+/* plans kept before the cache is emptied and started afresh */
+#define SERVE_PLANS 1024
+
+/* longest plan and data frames read, longer frames are skipped */
+#define SERVE_SPEC_MAX 4096
+#define SERVE_DATA_MAX (64 * 1024 * 1024)
+
+typedef struct serve_t {
+    const apr_getopt_option_t *opts;
+    /* plans, keyed by their spec */
+    apr_pool_t *ppool;
+    apr_hash_t *plans;
+    /* cleared after each request */
+    apr_pool_t *rpool;
+    /* request and response buffers, reused from one request to the next */
+    char *spec;
+    apr_size_t specsize;
+    char *data;
+    apr_size_t datasize;
+    char *resp;
+    apr_size_t respsize;
+} serve_t;
+
+static apr_status_t cleanup_serve(void *dummy)
+{
+    serve_t *serve = dummy;
+
+    free(serve->spec);
+    free(serve->data);
+    free(serve->resp);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Read one frame. Returns APR_EOF if the caller went away between
+ * requests, and APR_INCOMPLETE if the caller went away part way through.
+ * A frame longer than max is read and thrown away without room being made
+ * for it, and APR_ENOSPC is returned.
+ */
+static apr_status_t read_frame(apr_file_t *rd, char **buf, apr_size_t *size,
+        apr_size_t *len, apr_size_t max, int first)
+{
+    apr_status_t status;
+    apr_uint32_t length;
+    apr_size_t l;
+
+    status = apr_file_read_full(rd, &length, sizeof(length), &l);
+    if (status == APR_EOF) {
+        return (first && !l) ? APR_EOF : APR_INCOMPLETE;
+    }
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    if (length > max) {
+        char skip[4096];
+
+        while (length) {
+            status = apr_file_read_full(rd, skip,
+                    length < sizeof(skip) ? length : sizeof(skip), &l);
+            if (status == APR_EOF) {
+                return APR_INCOMPLETE;
+            }
+            if (status != APR_SUCCESS) {
+                return status;
+            }
+            length -= l;
+        }
+
+        return APR_ENOSPC;
+    }
+
+    status = endec_reserve(buf, size, length);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_file_read_full(rd, *buf, length, &l);
+    if (status == APR_EOF && l < length) {
+        return APR_INCOMPLETE;
+    }
+    if (status != APR_SUCCESS && status != APR_EOF) {
+        return status;
+    }
+
+    (*buf)[length] = 0;
+    *len = length;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Write the error and the result as two frames, in a single write.
+ */
+static apr_status_t write_response(serve_t *serve, apr_file_t *wr,
+        const char *error, const char *data, apr_size_t len)
+{
+    apr_status_t status;
+    apr_uint32_t size;
+    apr_size_t errlen = strlen(error), l;
+    char *off;
+
+    status = endec_reserve(&serve->resp, &serve->respsize,
+            2 * sizeof(size) + errlen + len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    off = serve->resp;
+
+    size = errlen;
+    memcpy(off, &size, sizeof(size));
+    off += sizeof(size);
+    memcpy(off, error, errlen);
+    off += errlen;
+
+    size = len;
+    memcpy(off, &size, sizeof(size));
+    off += sizeof(size);
+    if (len) {
+        memcpy(off, data, len);
+        off += len;
+    }
+
+    return apr_file_write_full(wr, serve->resp, off - serve->resp, &l);
+}
+
+/*
+ * Find the plan for the spec, parsing and caching it if not seen before.
+ */
+static endec_chain_t *plan_get(serve_t *serve, const char *spec,
+        apr_size_t speclen, const char **error)
+{
+    endec_chain_t *chain;
+    endec_stage_t *stage;
+    apr_getopt_t *opt;
+    apr_status_t status;
+    apr_pool_t *pool;
+    const char *optarg;
+    char **argv;
+    char *key;
+    int argc = 0, optch;
+
+    chain = apr_hash_get(serve->plans, spec, speclen);
+    if (chain) {
+        return chain;
+    }
+
+    if (apr_hash_count(serve->plans) >= SERVE_PLANS) {
+        apr_pool_clear(serve->ppool);
+        serve->plans = apr_hash_make(serve->ppool);
+    }
+
+    /* the options parser skips the program name */
+    apr_tokenize_to_argv(apr_pstrcat(serve->rpool, "endec ", spec, NULL),
+            &argv, serve->rpool);
+    while (argv[argc]) {
+        argc++;
+    }
+
+    /* each plan has a pool of its own, so a rejected plan leaves nothing */
+    apr_pool_create(&pool, serve->ppool);
+
+    chain = endec_chain_make(pool, NULL, APR_SIZE_MAX);
+    endec_chain_capture(chain);
+
+    apr_getopt_init(&opt, serve->rpool, argc, (const char * const *)argv);
+    opt->errfn = NULL;
+    while ((status = apr_getopt_long(opt, serve->opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        stage = endec_stage_make(pool, optch);
+        if (!stage) {
+            *error = apr_psprintf(serve->rpool,
+                    "Only transformations can be used in the plan '%s'.\n",
+                    spec);
+            apr_pool_destroy(pool);
+            return NULL;
+        }
+
+        endec_chain_add(chain, stage);
+    }
+    if (status != APR_EOF || opt->ind < argc) {
+        *error = apr_psprintf(serve->rpool,
+                "Could not parse the plan '%s'.\n", spec);
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    key = apr_pstrmemdup(pool, spec, speclen);
+    apr_hash_set(serve->plans, key, speclen, chain);
+
+    return chain;
+}
+
+int endec_serve(apr_pool_t *pool, apr_file_t *rd, apr_file_t *wr,
+        apr_file_t *err, const apr_getopt_option_t *opts)
+{
+    serve_t *serve = apr_pcalloc(pool, sizeof(serve_t));
+    apr_status_t status;
+    endec_chain_t *chain;
+    const char *error;
+    apr_size_t speclen, len;
+
+    serve->opts = opts;
+    apr_pool_create(&serve->ppool, pool);
+    apr_pool_create(&serve->rpool, pool);
+    serve->plans = apr_hash_make(serve->ppool);
+
+    apr_pool_cleanup_register(pool, serve, cleanup_serve, cleanup_serve);
+
+    while (1) {
+
+        error = "";
+        chain = NULL;
+
+        status = read_frame(rd, &serve->spec, &serve->specsize, &speclen,
+                SERVE_SPEC_MAX, 1);
+        if (status == APR_EOF) {
+            return 0;
+        }
+        if (status == APR_ENOSPC) {
+            error = apr_psprintf(serve->rpool,
+                    "Plan too large, the limit is %d bytes.\n",
+                    SERVE_SPEC_MAX);
+            status = APR_SUCCESS;
+        }
+        if (status == APR_SUCCESS) {
+            status = read_frame(rd, &serve->data, &serve->datasize, &len,
+                    SERVE_DATA_MAX, 0);
+            if (status == APR_ENOSPC) {
+                if (!*error) {
+                    error = apr_psprintf(serve->rpool,
+                            "Data too large, the limit is %d bytes.\n",
+                            SERVE_DATA_MAX);
+                }
+                status = APR_SUCCESS;
+            }
+        }
+        if (status != APR_SUCCESS) {
+            apr_file_printf(err,
+                    "Could not read request: %pm\n", &status);
+            return 1;
+        }
+
+        if (!*error) {
+            chain = plan_get(serve, serve->spec, speclen, &error);
+        }
+        if (chain) {
+            endec_chain_reset(chain);
+
+            status = endec_chain_write(chain, serve->data, len, 1);
+            if (chain->failed) {
+                error = chain->failed->error;
+            }
+            else if (status != APR_SUCCESS) {
+                error = apr_psprintf(serve->rpool,
+                        "Could not transform data: %pm\n", &status);
+            }
+            else if (chain->olen > APR_UINT32_MAX) {
+                error = "Result too large for a frame.\n";
+            }
+        }
+
+        if (*error) {
+            status = write_response(serve, wr, error, NULL, 0);
+        }
+        else {
+            status = write_response(serve, wr, error, chain->obuf,
+                    chain->olen);
+        }
+        if (status != APR_SUCCESS) {
+            apr_file_printf(err,
+                    "Could not write: %pm\n", &status);
+            return 1;
+        }
+
+        apr_pool_clear(serve->rpool);
+
+    }
+
+    return 0;
+}
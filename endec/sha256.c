@@ -0,0 +1,280 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - SHA-256 as per FIPS 180-4
+ *
+ * APR offers SHA-1 and MD5 but not SHA-256, so it is done here, with a
+ * kernel for the SHA extensions where the CPU has them.
+ */
+
+#include <string.h>
+
+#include <apr.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+static const apr_uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static apr_uint32_t load_be32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16)
+            | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static void store_be32(unsigned char *p, apr_uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * Digest n blocks of 64 bytes.
+ */
+static void blocks_scalar(apr_uint32_t *state, const unsigned char *p,
+        apr_size_t n)
+{
+    apr_uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (; n; n--, p += 64) {
+
+        for (i = 0; i < 16; i++) {
+            w[i] = load_be32(p + i * 4);
+        }
+        for (i = 16; i < 64; i++) {
+            w[i] = w[i - 16] + w[i - 7]
+                    + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18)
+                            ^ (w[i - 15] >> 3))
+                    + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19)
+                            ^ (w[i - 2] >> 10));
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+                    + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+                    + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if ENDEC_X86
+
+/* four rounds, two at a time, with the message words given */
+#define SHANI_ROUNDS(m, i) \
+    msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)(k + (i)))); \
+    st1 = _mm_sha256rnds2_epu32(st1, st0, msg); \
+    st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0e))
+
+/* the next four message words, from the sixteen before them */
+#define SHANI_SCHEDULE(m0, m1, m2, m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), \
+            _mm_alignr_epi8(m3, m2, 4)), m3)
+
+/*
+ * The SHA instructions keep the state as ABEF and CDGH rather than in
+ * order, and work on the message words in little endian order.
+ */
+__attribute__((target("sha,sse4.1")))
+static void blocks_shani(apr_uint32_t *state, const unsigned char *p,
+        apr_size_t n)
+{
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+            11, 10, 9, 8, 15, 14, 13, 12);
+    __m128i st0, st1, abef, cdgh, msg, tmp, m0, m1, m2, m3;
+    int i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);
+    st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)),
+            0x1b);
+    st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+    for (; n; n--, p += 64) {
+
+        abef = st0;
+        cdgh = st1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), swap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+                swap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)),
+                swap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)),
+                swap);
+
+        SHANI_ROUNDS(m0, 0);
+        SHANI_ROUNDS(m1, 4);
+        SHANI_ROUNDS(m2, 8);
+        SHANI_ROUNDS(m3, 12);
+
+        for (i = 16; i < 64; i += 16) {
+            SHANI_SCHEDULE(m0, m1, m2, m3);
+            SHANI_ROUNDS(m0, i);
+            SHANI_SCHEDULE(m1, m2, m3, m0);
+            SHANI_ROUNDS(m1, i + 4);
+            SHANI_SCHEDULE(m2, m3, m0, m1);
+            SHANI_ROUNDS(m2, i + 8);
+            SHANI_SCHEDULE(m3, m0, m1, m2);
+            SHANI_ROUNDS(m3, i + 12);
+        }
+
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1b);
+    st1 = _mm_shuffle_epi32(st1, 0xb1);
+    _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, st1, 0xf0));
+    _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(st1, tmp, 8));
+}
+
+#endif
+
+static void (*blocks)(apr_uint32_t *state, const unsigned char *p,
+        apr_size_t n) = blocks_scalar;
+
+void endec_sha256_init(int cpu)
+{
+    blocks = blocks_scalar;
+
+#if ENDEC_X86
+    if ((cpu & ENDEC_CPU_SHA) && (cpu & ENDEC_CPU_SSE41)) {
+        blocks = blocks_shani;
+    }
+#endif
+}
+
+void endec_sha256_start(endec_sha256_t *ctx)
+{
+    static const apr_uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, h, sizeof(h));
+    ctx->count = 0;
+}
+
+void endec_sha256_update(endec_sha256_t *ctx, const char *src,
+        apr_size_t slen)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    apr_size_t used = ctx->count % 64, n;
+
+    ctx->count += slen;
+
+    /* finish the block left over from last time */
+    if (used) {
+        n = 64 - used;
+        if (n > slen) {
+            n = slen;
+        }
+        memcpy(ctx->buf + used, in, n);
+        in += n;
+        slen -= n;
+        if (used + n < 64) {
+            return;
+        }
+        blocks(ctx->state, ctx->buf, 1);
+    }
+
+    /* whole blocks are digested where they lie */
+    if (slen >= 64) {
+        blocks(ctx->state, in, slen / 64);
+        in += slen & ~(apr_size_t)63;
+        slen %= 64;
+    }
+
+    memcpy(ctx->buf, in, slen);
+}
+
+void endec_sha256_final(unsigned char *digest, endec_sha256_t *ctx)
+{
+    apr_size_t used = ctx->count % 64;
+    apr_uint64_t bits = ctx->count * 8;
+    int i;
+
+    /* a one bit, zeros, and the length in bits to end the last block */
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        blocks(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    store_be32(ctx->buf + 56, (apr_uint32_t)(bits >> 32));
+    store_be32(ctx->buf + 60, (apr_uint32_t)bits);
+    blocks(ctx->state, ctx->buf, 1);
+
+    for (i = 0; i < 8; i++) {
+        store_be32(digest + i * 4, ctx->state[i]);
+    }
+}
@@ -0,0 +1,2178 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - the chain of transformations, applied a chunk at a time
+ *
+ */
+
+#include <stdlib.h>
+
+#include <apr.h>
+#include <apr_encode.h>
+#include <apr_escape.h>
+#include <apr_md5.h>
+#include <apr_sha1.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+
+#include "config.h"
+#include "endec.h"
+
+#define ESCAPE_STARTED 1
+#define DIGEST_STARTED 1
+
+/* the running digest of a digest stage */
+typedef union digest_ctx_t {
+    apr_sha1_ctx_t sha1;
+    apr_md5_ctx_t md5;
+    endec_sha256_t sha256;
+} digest_ctx_t;
+
+/* input decoded at a time when only the size of the output is wanted */
+#define DISCARD_WINDOW 4096
+
+static apr_size_t bound_base64(endec_stage_t *stage, apr_size_t inlen)
+{
+    return (inlen + 2) / 3 * 4;
+}
+
+static apr_size_t bound_wrap(endec_stage_t *stage, apr_size_t inlen)
+{
+    apr_size_t len = bound_base64(stage, inlen);
+
+    /* a newline after each line, and after the line carried over */
+    return len + len / stage->wrap + 2;
+}
+
+static apr_size_t bound_base32(endec_stage_t *stage, apr_size_t inlen)
+{
+    return (inlen + 4) / 5 * 8;
+}
+
+static apr_size_t bound_base16(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* allow for the colon joining this chunk to the previous one */
+    return inlen * 3 + 1;
+}
+
+static apr_size_t bound_base85(endec_stage_t *stage, apr_size_t inlen)
+{
+    return (inlen + 3) / 4 * 5;
+}
+
+static apr_size_t bound_decode(endec_stage_t *stage, apr_size_t inlen)
+{
+    return inlen;
+}
+
+static apr_size_t bound_percent(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* "%XX" */
+    return inlen * 3;
+}
+
+static apr_size_t bound_entity(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* "&quot;" or "&#NNN;" */
+    return inlen * 6;
+}
+
+static apr_size_t bound_echo(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* "\xHH" */
+    return inlen * 4;
+}
+
+static apr_size_t bound_json(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* "\u00XX" */
+    return inlen * 6;
+}
+
+static apr_size_t bound_ldap(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* "\XX" */
+    return inlen * 3;
+}
+
+static apr_size_t bound_digest(endec_stage_t *stage, apr_size_t inlen)
+{
+    switch (stage->opt) {
+    case OPT_SHA1:
+        return APR_SHA1_DIGESTSIZE;
+    case OPT_MD5:
+        return APR_MD5_DIGESTSIZE;
+    }
+
+    return ENDEC_SHA256_DIGESTSIZE;
+}
+
+static apr_size_t bound_none(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* the input is passed on, nothing is written */
+    return 0;
+}
+
+apr_status_t endec_reserve(char **buf, apr_size_t *bufsize,
+        apr_size_t size)
+{
+    char *b;
+
+    if (*buf && *bufsize >= size) {
+        return APR_SUCCESS;
+    }
+
+    b = realloc(*buf, size + 1);
+    if (!b) {
+        return APR_ENOMEM;
+    }
+
+    *buf = b;
+    *bufsize = size;
+
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_THREADS
+
+static void * APR_THREAD_FUNC piece_run(apr_thread_t *thread, void *data)
+{
+    endec_piece_t *piece = data;
+    endec_chain_t *chain = piece->chain;
+
+    piece->status = piece->codec(piece->out, piece->in, piece->inlen,
+            piece->flags, &piece->outlen);
+
+    apr_thread_mutex_lock(chain->mutex);
+    if (!--chain->pending) {
+        apr_thread_cond_signal(chain->cond);
+    }
+    apr_thread_mutex_unlock(chain->mutex);
+
+    return NULL;
+}
+
+#endif
+
+/*
+ * Work out the size of the output of an encoder from the size of its
+ * input. Returns APR_NOTFOUND for a decoder.
+ */
+static apr_status_t codec_length(endec_codec_fn codec, apr_size_t inlen,
+        int flags, apr_size_t *outlen)
+{
+    int nopad = (flags & APR_ENCODE_NOPADDING);
+
+    if (codec == endec_encode_base64) {
+        *outlen = inlen / 3 * 4
+                + (nopad ? (inlen % 3 * 4 + 2) / 3 : (inlen % 3 ? 4 : 0));
+    }
+    else if (codec == endec_encode_base32) {
+        *outlen = inlen / 5 * 8
+                + (nopad ? (inlen % 5 * 8 + 4) / 5 : (inlen % 5 ? 8 : 0));
+    }
+    else if (codec == endec_encode_base16) {
+        *outlen = (flags & APR_ENCODE_COLON) && inlen ? inlen * 3 - 1
+                : inlen * 2;
+    }
+    else if (codec == endec_encode_base85
+            && !(flags & ENDEC_BASE85_ASCII85)) {
+        *outlen = inlen / 4 * 5 + (inlen % 4 ? inlen % 4 + 1 : 0);
+    }
+    else {
+        return APR_NOTFOUND;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Work out the size of the output of an encoder or decoder without
+ * making it. An encoder needs only the size of its input, while a decoder
+ * is run over a window at a time into a scratch buffer, so that the data
+ * is still checked. Each window but the last ends with insep when set.
+ */
+static apr_status_t stage_discard(endec_codec_fn codec, apr_size_t unit,
+        char insep, const char *in, apr_size_t inlen, int flags,
+        apr_size_t *outlen)
+{
+    char scratch[DISCARD_WINDOW];
+    apr_size_t window = DISCARD_WINDOW / unit * unit, n, len, l;
+    apr_status_t status;
+
+    if (codec_length(codec, inlen, flags, outlen) == APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+
+    *outlen = 0;
+
+    while (inlen) {
+
+        n = len = (inlen > window) ? window : inlen;
+
+        if (insep && n < inlen) {
+            if (in[--len] != insep) {
+                return APR_BADCH;
+            }
+        }
+
+        status = codec(scratch, in, len, flags, &l);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        *outlen += l;
+        in += n;
+        inlen -= n;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Run an encoder or decoder over the input, writing to the stage output
+ * buffer from offset off.
+ *
+ * Large inputs are split into pieces of whole blocks of unit bytes, and
+ * the pieces are handed out to the thread pool. When insep is set, each
+ * piece of input but the last ends with the separator, which is checked
+ * and removed before the piece is run. When outsep is set, the output of
+ * the pieces is joined with the separator.
+ *
+ * The outcome is the same as running over the input in one go. The first
+ * piece to fail decides the result, and nothing is output on failure.
+ */
+static apr_status_t stage_codec(endec_stage_t *stage, endec_codec_fn codec,
+        apr_size_t unit, char insep, char outsep, apr_size_t off,
+        const char *in, apr_size_t inlen, int flags, apr_size_t *outlen)
+{
+#if APR_HAS_THREADS
+    endec_chain_t *chain = stage->chain;
+    endec_piece_t *piece;
+    apr_status_t status;
+    apr_size_t size, start, total = off, n, i;
+
+    if (stage->discard) {
+        return stage_discard(codec, unit, insep, in, inlen, flags, outlen);
+    }
+
+    n = inlen / ENDEC_PIECE_SIZE;
+    if (!chain || n > (apr_size_t)chain->threads) {
+        n = chain ? chain->threads : 1;
+    }
+    size = n ? inlen / n / unit * unit : 0;
+
+    /* too little to share */
+    if (n < 2 || !size) {
+        return codec(stage->out + off, in, inlen, flags, outlen);
+    }
+
+    /* give each piece room for its own output */
+    for (i = 0, start = 0; i < n; i++, start += size) {
+        piece = &chain->pieces[i];
+        piece->chain = chain;
+        piece->codec = codec;
+        piece->flags = flags;
+        piece->in = in + start;
+        piece->inlen = (i < n - 1) ? size : inlen - start;
+        piece->outlen = 0;
+        piece->status = APR_SUCCESS;
+
+        /* the previous piece must end with its separator */
+        if (insep && i < n - 1) {
+            if (piece->in[--piece->inlen] != insep) {
+                return APR_BADCH;
+            }
+        }
+
+        piece->sep = (outsep && i) ? 1 : 0;
+        piece->off = total;
+        total += piece->sep + stage->bound(stage, piece->inlen);
+    }
+
+    status = endec_reserve(&stage->out, &stage->outsize, total);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    chain->pending = n - 1;
+
+    for (i = 0; i < n; i++) {
+        piece = &chain->pieces[i];
+        if (piece->sep) {
+            stage->out[piece->off] = outsep;
+        }
+        piece->out = stage->out + piece->off + piece->sep;
+        if (i && apr_thread_pool_push(chain->tp, piece_run, piece,
+                APR_THREAD_TASK_PRIORITY_NORMAL, NULL) != APR_SUCCESS) {
+            piece_run(NULL, piece);
+        }
+    }
+
+    /* take the first piece ourselves while the pool does the rest */
+    piece = &chain->pieces[0];
+    piece->status = codec(piece->out, piece->in, piece->inlen, flags,
+            &piece->outlen);
+
+    apr_thread_mutex_lock(chain->mutex);
+    while (chain->pending) {
+        apr_thread_cond_wait(chain->cond, chain->mutex);
+    }
+    apr_thread_mutex_unlock(chain->mutex);
+
+    /* close up the gaps between the pieces */
+    for (i = 0, total = off; i < n; i++) {
+        piece = &chain->pieces[i];
+        if (piece->status != APR_SUCCESS) {
+            return piece->status;
+        }
+        size = piece->sep + piece->outlen;
+        if (i) {
+            memmove(stage->out + total, stage->out + piece->off, size);
+        }
+        total += size;
+    }
+
+    *outlen = total - off;
+
+    return APR_SUCCESS;
+#else
+    if (stage->discard) {
+        return stage_discard(codec, unit, insep, in, inlen, flags, outlen);
+    }
+
+    return codec(stage->out + off, in, inlen, flags, outlen);
+#endif
+}
+
+/*
+ * Return the number of newlines that len more bytes of output on the
+ * current line take, including the one ending the last line at the end
+ * of the stream.
+ */
+static apr_size_t wrap_newlines(endec_stage_t *stage, apr_size_t len,
+        int eos)
+{
+    apr_size_t col = stage->state + len;
+
+    return col / stage->wrap + (eos && col % stage->wrap);
+}
+
+/*
+ * Lay out the len bytes of output found gap bytes into the stage output
+ * as lines, where gap is the number of newlines to be added. Each line
+ * is moved down into place in turn, so that the output is only made
+ * once. The column is carried from one chunk to the next in the stage
+ * state. Returns the length of the result.
+ */
+static apr_size_t wrap_lines(endec_stage_t *stage, apr_size_t gap,
+        apr_size_t len, int eos)
+{
+    char *out = stage->out;
+    apr_size_t col = stage->state, dst = 0, src = gap, n;
+
+    if (stage->discard) {
+        stage->state = eos ? 0 : (col + len) % stage->wrap;
+        return len + gap;
+    }
+
+    while (len) {
+        n = stage->wrap - col;
+        if (n > len) {
+            n = len;
+        }
+
+        memmove(out + dst, out + src, n);
+        dst += n;
+        src += n;
+        len -= n;
+        col += n;
+
+        if (col == stage->wrap) {
+            out[dst++] = '\n';
+            col = 0;
+        }
+    }
+
+    if (eos && col) {
+        out[dst++] = '\n';
+        col = 0;
+    }
+
+    stage->state = col;
+
+    return dst;
+}
+
+static apr_status_t encode_base64(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    /* only the final chunk may end in a partial block */
+    apr_size_t len = eos ? inlen : inlen - inlen % 3, gap = 0;
+    apr_status_t status;
+
+    *consumed = len;
+
+    /* encode past the room the newlines will take */
+    if (stage->wrap) {
+        codec_length(endec_encode_base64, len, stage->flags, &gap);
+        gap = wrap_newlines(stage, gap, eos);
+    }
+
+    status = stage_codec(stage, endec_encode_base64, 3, 0, 0, gap, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    if (status == APR_SUCCESS && stage->wrap) {
+        *outlen = wrap_lines(stage, gap, *outlen, eos);
+    }
+
+    return status;
+}
+
+static apr_status_t encode_base32(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    /* only the final chunk may end in a partial block */
+    apr_size_t len = eos ? inlen : inlen - inlen % 5;
+    apr_status_t status;
+
+    *consumed = len;
+
+    status = stage_codec(stage, endec_encode_base32, 5, 0, 0, 0, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+static apr_status_t encode_base16(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t off = 0;
+    char sep = (stage->flags & APR_ENCODE_COLON) ? ':' : 0;
+
+    *out = stage->out;
+    *consumed = inlen;
+
+    if (!inlen) {
+        *outlen = 0;
+        return APR_SUCCESS;
+    }
+
+    /* join this chunk to the one before */
+    if (sep && stage->state) {
+        if (!stage->discard) {
+            stage->out[off] = sep;
+        }
+        off++;
+    }
+    stage->state = 1;
+
+    status = stage_codec(stage, endec_encode_base16, 1, 0, sep, off, in,
+            inlen, stage->flags, outlen);
+    *outlen += off;
+    *out = stage->out;
+
+    return status;
+}
+
+static apr_status_t encode_base85(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    /* only the final chunk may end in a partial block */
+    apr_size_t len = eos ? inlen : inlen - inlen % 4;
+    apr_status_t status;
+
+    *consumed = len;
+
+    status = stage_codec(stage, endec_encode_base85, 4, 0, 0, 0, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+/*
+ * Once padding has been seen, nothing but further padding may follow.
+ */
+static apr_status_t decode_padding(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, apr_size_t *len)
+{
+    const char *pad;
+
+    if (stage->state) {
+        pad = in;
+    }
+    else if (!(pad = memchr(in, '=', inlen))) {
+        return APR_SUCCESS;
+    }
+
+    stage->state = 1;
+    *len = inlen;
+
+    while (pad < in + inlen) {
+        if (*pad++ != '=') {
+            return APR_BADCH;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t decode_base64(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t len = eos ? inlen : inlen - inlen % 4;
+
+    *out = stage->out;
+
+    if (stage->state) {
+        *consumed = inlen;
+        *outlen = 0;
+        return decode_padding(stage, in, inlen, &len);
+    }
+
+    status = decode_padding(stage, in, inlen, &len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    *consumed = len;
+
+    status = stage_codec(stage, endec_decode_base64, 4, 0, 0, 0, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+/*
+ * Copy src to dest without the bytes in the class, returning the length
+ * copied. The runs between the bytes are found by the vector kernels.
+ */
+static apr_size_t strip_class(const endec_class_t *cls, char *dest,
+        const char *src, apr_size_t slen)
+{
+    apr_size_t len = 0, n;
+
+    while (slen) {
+        n = endec_class_span(cls, src, slen);
+        memcpy(dest + len, src, n);
+        len += n;
+        src += n;
+        slen -= n;
+
+        while (slen && cls->member[(unsigned char)*src]) {
+            src++;
+            slen--;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Decode base64 broken into lines. The whitespace is taken out before
+ * the data is decoded as it would be by decode_base64().
+ */
+static apr_status_t decode_base64_wrapped(endec_stage_t *stage,
+        const char *in, apr_size_t inlen, int eos, const char **out,
+        apr_size_t *outlen, apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t slen, len, left;
+
+    *out = stage->out;
+    *outlen = 0;
+    *consumed = inlen;
+
+    status = endec_reserve(&stage->strip, &stage->stripsize, inlen);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    slen = strip_class(&stage->special, stage->strip, in, inlen);
+
+    if (stage->state) {
+        return decode_padding(stage, stage->strip, slen, &len);
+    }
+
+    len = eos ? slen : slen - slen % 4;
+    status = decode_padding(stage, stage->strip, slen, &len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    /* leave a partial block, and the whitespace within it, for next time */
+    for (left = slen - len; left; ) {
+        if (!stage->special.member[(unsigned char)in[--*consumed]]) {
+            left--;
+        }
+    }
+
+    status = stage_codec(stage, endec_decode_base64, 4, 0, 0, 0,
+            stage->strip, len, stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+/*
+ * Ascii85 writes a block of zeros as 'z', so where there is a 'z' the
+ * blocks can only be found by decoding them in turn, and the output can
+ * be larger than the bound.
+ */
+static apr_status_t decode_base85(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    const char *z, *last = NULL;
+    apr_size_t len = eos ? inlen : inlen - inlen % 5, zeros = 0;
+    apr_status_t status;
+
+    if (stage->flags & ENDEC_BASE85_ASCII85) {
+        for (z = in; (z = memchr(z, 'z', in + inlen - z)); z++) {
+            last = z;
+            zeros++;
+        }
+    }
+
+    *out = stage->out;
+
+    if (zeros) {
+
+        /* whole blocks follow the last 'z' */
+        if (!eos) {
+            len = inlen - (in + inlen - last - 1) % 5;
+        }
+        *consumed = len;
+
+        status = endec_reserve(&stage->out, &stage->outsize,
+                len + zeros * 3);
+        *out = stage->out;
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        return endec_decode_base85(stage->out, in, len, stage->flags,
+                outlen);
+    }
+
+    *consumed = len;
+
+    status = stage_codec(stage, endec_decode_base85, 5, 0, 0, 0, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+static apr_status_t decode_base32(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t len = eos ? inlen : inlen - inlen % 8;
+
+    *out = stage->out;
+
+    if (stage->state) {
+        *consumed = inlen;
+        *outlen = 0;
+        return decode_padding(stage, in, inlen, &len);
+    }
+
+    status = decode_padding(stage, in, inlen, &len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    *consumed = len;
+
+    status = stage_codec(stage, endec_decode_base32, 8, 0, 0, 0, in, len,
+            stage->flags, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+#define BASE16_UNKNOWN 0
+#define BASE16_PLAIN 1
+#define BASE16_COLON 2
+
+static apr_status_t decode_base16(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t len;
+
+    *out = stage->out;
+    *outlen = 0;
+    *consumed = 0;
+
+    /* colon separated data is recognised by the first separator */
+    if (stage->state == BASE16_UNKNOWN) {
+        if (inlen > 2) {
+            stage->state = in[2] == ':' ? BASE16_COLON : BASE16_PLAIN;
+        }
+        else if (!eos) {
+            return APR_SUCCESS;
+        }
+        else {
+            stage->state = BASE16_PLAIN;
+        }
+    }
+
+    /*
+     * Later chunks and pieces keep the layout of the first, rather than
+     * being recognised afresh.
+     */
+    if (stage->state == BASE16_PLAIN) {
+        len = eos ? inlen : inlen - inlen % 2;
+        *consumed = len;
+        status = stage_codec(stage, endec_decode_base16, 2, 0, 0, 0, in, len,
+                stage->flags | ENDEC_BASE16_PLAIN, outlen);
+        *out = stage->out;
+        return status;
+    }
+
+    /* decode whole "XX:" groups, leaving off the trailing colon */
+    if (eos) {
+        *consumed = len = inlen;
+    }
+    else {
+        *consumed = len = inlen - inlen % 3;
+        if (!len) {
+            return APR_SUCCESS;
+        }
+        if (in[--len] != ':') {
+            return APR_BADCH;
+        }
+    }
+
+    status = stage_codec(stage, endec_decode_base16, 3, ':', 0, 0, in, len,
+            stage->flags | ENDEC_BASE16_COLON, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+/*
+ * Decode base64 and encode it again as base16 or base64 in one pass, as
+ * decode_base64() followed by the fused encoder would.
+ */
+static apr_status_t transcode_base64(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    endec_stage_t *enc = stage->fused;
+    endec_codec_fn codec = endec_base64_base64;
+    apr_status_t status;
+    apr_size_t len = eos ? inlen : inlen - inlen % 4, off = 0;
+    char sep = 0;
+
+    *out = stage->out;
+
+    if (stage->state) {
+        *consumed = inlen;
+        *outlen = 0;
+        return decode_padding(stage, in, inlen, &len);
+    }
+
+    status = decode_padding(stage, in, inlen, &len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    *consumed = len;
+
+    if (enc->transform == encode_base16) {
+        codec = endec_base64_base16;
+        sep = (enc->flags & APR_ENCODE_COLON) ? ':' : 0;
+    }
+
+    /* join this chunk to the one before */
+    if (sep && enc->state) {
+        stage->out[off++] = sep;
+    }
+
+    status = stage_codec(stage, codec, 4, 0, sep, off, in, len, enc->flags,
+            outlen);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    /* nothing decoded, nothing to join */
+    if (!*outlen) {
+        return APR_SUCCESS;
+    }
+
+    enc->state = 1;
+    *outlen += off;
+    *out = stage->out;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Decode base16 and encode it again as base64 in one pass, as
+ * decode_base16() followed by encode_base64() would. Whole base64 groups
+ * are decoded, so that only the last chunk encodes with padding.
+ */
+static apr_status_t transcode_base16(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    endec_stage_t *enc = stage->fused;
+    apr_status_t status;
+    apr_size_t len;
+
+    *out = stage->out;
+    *outlen = 0;
+    *consumed = 0;
+
+    /* colon separated data is recognised by the first separator */
+    if (stage->state == BASE16_UNKNOWN) {
+        if (inlen > 2) {
+            stage->state = in[2] == ':' ? BASE16_COLON : BASE16_PLAIN;
+        }
+        else if (!eos) {
+            return APR_SUCCESS;
+        }
+        else {
+            stage->state = BASE16_PLAIN;
+        }
+    }
+
+    if (stage->state == BASE16_PLAIN) {
+        len = eos ? inlen : inlen - inlen % 6;
+        *consumed = len;
+        status = stage_codec(stage, endec_base16_base64, 6, 0, 0, 0, in, len,
+                enc->flags | ENDEC_BASE16_PLAIN, outlen);
+        *out = stage->out;
+        return status;
+    }
+
+    /* decode whole "XX:XX:XX:" groups, leaving off the trailing colon */
+    if (eos) {
+        *consumed = len = inlen;
+    }
+    else {
+        *consumed = len = inlen - inlen % 9;
+        if (!len) {
+            return APR_SUCCESS;
+        }
+        if (in[--len] != ':') {
+            return APR_BADCH;
+        }
+    }
+
+    status = stage_codec(stage, endec_base16_base64, 9, ':', 0, 0, in, len,
+            enc->flags | ENDEC_BASE16_COLON, outlen);
+    *out = stage->out;
+
+    return status;
+}
+
+static apr_size_t bound_transcode(endec_stage_t *stage, apr_size_t inlen)
+{
+    /* the most the decoder can hand to the encoder */
+    if (stage->transform == transcode_base16) {
+        inlen = (inlen + 1) / 2;
+    }
+    else {
+        inlen = (inlen + 3) / 4 * 3;
+    }
+
+    return stage->fused->bound(stage->fused, inlen);
+}
+
+/*
+ * How much of the input may be unescaped without splitting an escape
+ * sequence that continues into the next chunk.
+ */
+static apr_size_t unescape_whole(endec_stage_t *stage, const char *in,
+        apr_size_t inlen)
+{
+    const char *semi, *amp;
+
+    switch (stage->opt) {
+    case OPT_DECODE_URL:
+    case OPT_DECODE_FORM: {
+
+        if (inlen > 0 && in[inlen - 1] == '%') {
+            return inlen - 1;
+        }
+        if (inlen > 1 && in[inlen - 2] == '%') {
+            return inlen - 2;
+        }
+
+        break;
+    }
+    case OPT_DECODE_ENTITY: {
+
+        /* an entity runs from an ampersand to the next semicolon */
+        for (semi = in + inlen; semi > in && semi[-1] != ';'; semi--);
+
+        for (amp = semi; (amp = memchr(amp, '&', in + inlen - amp)); amp++) {
+
+            /* numeric entities swallow everything up to the semicolon */
+            if (amp + 1 == in + inlen || amp[1] == '#') {
+                return amp - in;
+            }
+
+            /* named entities are short */
+            if (in + inlen - amp <= ENDEC_ENTITY_MAX + 1) {
+                return amp - in;
+            }
+        }
+
+        break;
+    }
+    }
+
+    return inlen;
+}
+
+/*
+ * Escape a run of data holding no NUL with APR. The length given back
+ * includes a terminating NUL. This is only used to learn what each byte
+ * is written as when a stage is made.
+ */
+static apr_status_t escape_run(endec_stage_t *stage, char *dest,
+        const char *in, apr_size_t len, apr_size_t *size)
+{
+    switch (stage->opt) {
+    case OPT_URL: {
+        return apr_escape_path_segment(dest, in, len, size);
+    }
+    case OPT_FORM: {
+        return apr_escape_urlencoded(dest, in, len, size);
+    }
+    case OPT_PATH: {
+        return apr_escape_path(dest, in, len, 1, size);
+    }
+    case OPT_ENTITY: {
+        return apr_escape_entity(dest, in, len, 1, size);
+    }
+    case OPT_ECHO: {
+        return apr_escape_echo(dest, in, len, 0, size);
+    }
+    case OPT_ECHOQUOTE: {
+        return apr_escape_echo(dest, in, len, 1, size);
+    }
+    case OPT_LDAP: {
+        return apr_escape_ldap(dest, in, len, APR_ESCAPE_LDAP_ALL, size);
+    }
+    case OPT_LDAP_DN: {
+        return apr_escape_ldap(dest, in, len, APR_ESCAPE_LDAP_DN, size);
+    }
+    case OPT_LDAP_FILTER: {
+        return apr_escape_ldap(dest, in, len, APR_ESCAPE_LDAP_FILTER, size);
+    }
+    }
+
+    return APR_ENOTIMPL;
+}
+
+/*
+ * How a NUL is written, as most of the APR escape functions stop at a
+ * NUL rather than escape it. The url escapes write it the way they write
+ * other control characters, as does echo. Everything else passes a NUL
+ * unchanged, and NULL is returned.
+ */
+static const char *escape_nul(endec_stage_t *stage)
+{
+    switch (stage->opt) {
+    case OPT_URL:
+    case OPT_FORM:
+    case OPT_PATH: {
+        return "%00";
+    }
+    case OPT_ECHO:
+    case OPT_ECHOQUOTE: {
+        return "\\x00";
+    }
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the size the input would be once escaped.
+ */
+static apr_size_t escape_length(endec_stage_t *stage, const char *in,
+        apr_size_t inlen)
+{
+    apr_size_t total = 0, safe;
+
+    while (inlen) {
+
+        safe = endec_class_span(&stage->special, in, inlen);
+        total += safe;
+        in += safe;
+        inlen -= safe;
+
+        if (inlen) {
+            total += stage->replace->len[(unsigned char)*in++];
+            inlen--;
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Escape the input, copying the runs of bytes that need nothing done
+ * straight to the output, and writing the others from the table.
+ */
+static apr_status_t transform_escape(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_size_t safe;
+
+    *consumed = inlen;
+
+    /* with nothing to act on, the data is passed on as it is */
+    safe = endec_class_span(&stage->special, in, inlen);
+    if (safe == inlen) {
+        *out = in;
+        *outlen = inlen;
+        return APR_SUCCESS;
+    }
+
+    /* only the size is wanted, which the replacements give */
+    if (stage->discard) {
+        *out = NULL;
+        *outlen = escape_length(stage, in + safe, inlen - safe) + safe;
+        return APR_SUCCESS;
+    }
+
+    memcpy(stage->out, in, safe);
+
+    *out = stage->out;
+    *outlen = safe + endec_replace(&stage->special, stage->replace,
+            stage->out + safe, in + safe, inlen - safe);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Unescape the input, copying the runs of bytes that need nothing done
+ * straight to the output.
+ */
+static apr_status_t transform_unescape(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_status_t status;
+    apr_size_t len = inlen, safe, n, used;
+
+    if (!eos) {
+        len = unescape_whole(stage, in, inlen);
+    }
+
+    *out = in;
+    *consumed = len;
+    *outlen = len;
+
+    /* with nothing to act on, the data is passed on as it is */
+    safe = endec_class_span(&stage->special, in, len);
+    if (safe == len) {
+        stage->state |= ESCAPE_STARTED;
+        return APR_SUCCESS;
+    }
+
+    memcpy(stage->out, in, safe);
+
+    if (stage->opt == OPT_DECODE_ENTITY) {
+        status = endec_unescape_entity(&stage->special, stage->out + safe,
+                in + safe, len - safe, &n);
+    }
+    else if (stage->opt == OPT_DECODE_JSON) {
+        /* an escape cut short by the end of the chunk waits for the rest */
+        status = endec_unescape_json(&stage->special, stage->out + safe,
+                in + safe, len - safe, !eos, &used, &n);
+        *consumed = safe + used;
+    }
+    else {
+        status = endec_unescape_percent(&stage->special, stage->out + safe,
+                in + safe, len - safe, &n);
+    }
+
+    /*
+     * Numeric entities that decode to nothing only vanish if some other
+     * entity was decoded, which a chunk cannot know. Once the data spans
+     * chunks, always take the decoded form.
+     */
+    if (status == APR_NOTFOUND && eos
+            && !(stage->state & ESCAPE_STARTED)) {
+        return APR_SUCCESS;
+    }
+    if (status != APR_SUCCESS && status != APR_NOTFOUND) {
+        return APR_BADCH;
+    }
+
+    stage->state |= ESCAPE_STARTED;
+
+    *out = stage->out;
+    *outlen = safe + n;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Pass on the whole characters of valid UTF-8, keeping back a character
+ * cut short by the end of the chunk, and report where invalid data
+ * starts.
+ */
+static apr_status_t transform_utf8(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    apr_size_t n;
+    int cut;
+
+    n = endec_utf8_valid(in, inlen, &cut);
+
+    if (n < inlen && (!cut || eos)) {
+        apr_snprintf(stage->message, ENDEC_MESSAGE_MAX,
+                "Could not validate data, %s UTF-8 at byte offset %"
+                APR_UINT64_T_FMT ".\n", cut ? "truncated" : "invalid",
+                stage->seen + n);
+        stage->error = stage->message;
+        return APR_BADCH;
+    }
+
+    stage->seen += n;
+
+    *out = in;
+    *outlen = n;
+    *consumed = n;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Digest the input as it passes, writing nothing until the end of the
+ * data, when the digest is written as raw bytes for the next stage to
+ * encode.
+ */
+static apr_status_t transform_digest(endec_stage_t *stage, const char *in,
+        apr_size_t inlen, int eos, const char **out, apr_size_t *outlen,
+        apr_size_t *consumed)
+{
+    digest_ctx_t *ctx = stage->digest;
+    unsigned char *digest = (unsigned char *)stage->out;
+    apr_size_t n;
+
+    if (!(stage->state & DIGEST_STARTED)) {
+        switch (stage->opt) {
+        case OPT_SHA1:
+            apr_sha1_init(&ctx->sha1);
+            break;
+        case OPT_MD5:
+            apr_md5_init(&ctx->md5);
+            break;
+        default:
+            endec_sha256_start(&ctx->sha256);
+        }
+        stage->state |= DIGEST_STARTED;
+    }
+
+    *consumed = inlen;
+    *out = stage->out;
+    *outlen = 0;
+
+    switch (stage->opt) {
+    case OPT_SHA1:
+        /* apr_sha1 takes an unsigned int length */
+        while (inlen) {
+            n = inlen > APR_UINT32_MAX ? APR_UINT32_MAX : inlen;
+            apr_sha1_update_binary(&ctx->sha1, (const unsigned char *)in,
+                    (unsigned int)n);
+            in += n;
+            inlen -= n;
+        }
+        break;
+    case OPT_MD5:
+        apr_md5_update(&ctx->md5, in, inlen);
+        break;
+    default:
+        endec_sha256_update(&ctx->sha256, in, inlen);
+    }
+
+    if (!eos) {
+        return APR_SUCCESS;
+    }
+
+    switch (stage->opt) {
+    case OPT_SHA1:
+        apr_sha1_final(digest, &ctx->sha1);
+        break;
+    case OPT_MD5:
+        apr_md5_final(digest, &ctx->md5);
+        break;
+    default:
+        endec_sha256_final(digest, &ctx->sha256);
+    }
+
+    /* the next data, such as the next record, has a digest of its own */
+    stage->state &= ~DIGEST_STARTED;
+
+    *outlen = bound_digest(stage, 0);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t cleanup_stage(void *dummy)
+{
+    endec_stage_t *stage = dummy;
+
+    free(stage->buf);
+    free(stage->out);
+    free(stage->strip);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Each transformation, as carried out by a stage.
+ */
+typedef struct stage_def_t {
+    int opt;
+    /* message reported when the stage is given invalid data */
+    const char *error;
+    endec_transform_fn transform;
+    endec_bound_fn bound;
+    int flags;
+} stage_def_t;
+
+static const stage_def_t stage_defs[] = {
+    { OPT_URL,
+        "Could not url escape data.\n",
+        transform_escape, bound_percent, 0 },
+    { OPT_DECODE_URL,
+        "Could not url unescape data.\n",
+        transform_unescape, bound_decode, 0 },
+    { OPT_FORM,
+        "Could not form url escape data.\n",
+        transform_escape, bound_percent, 0 },
+    { OPT_DECODE_FORM,
+        "Could not form url unescape data.\n",
+        transform_unescape, bound_decode, 0 },
+    { OPT_PATH,
+        "Could not escape the path.\n",
+        transform_escape, bound_percent, 0 },
+    { OPT_ENTITY,
+        "Could not entity escape data.\n",
+        transform_escape, bound_entity, 0 },
+    { OPT_DECODE_ENTITY,
+        "Could not entity unescape data.\n",
+        transform_unescape, bound_decode, 0 },
+    { OPT_ECHO,
+        "Could not echo escape data.\n",
+        transform_escape, bound_echo, 0 },
+    { OPT_ECHOQUOTE,
+        "Could not quote echo escape data.\n",
+        transform_escape, bound_echo, 0 },
+    { OPT_LDAP,
+        "Could not ldap escape data.\n",
+        transform_escape, bound_ldap, 0 },
+    { OPT_LDAP_DN,
+        "Could not ldap escape distinguished name data.\n",
+        transform_escape, bound_ldap, 0 },
+    { OPT_LDAP_FILTER,
+        "Could not ldap escape filter data.\n",
+        transform_escape, bound_ldap, 0 },
+    { OPT_JSON,
+        "Could not json escape data.\n",
+        transform_escape, bound_json, 0 },
+    { OPT_DECODE_JSON,
+        "Could not json unescape data, invalid escape encountered.\n",
+        transform_unescape, bound_decode, 0 },
+    { OPT_UTF8_VALIDATE,
+        "Could not validate data, invalid UTF-8 encountered.\n",
+        transform_utf8, bound_none, 0 },
+    { OPT_SHA256,
+        "Could not sha256 digest data.\n",
+        transform_digest, bound_digest, 0 },
+    { OPT_SHA1,
+        "Could not sha1 digest data.\n",
+        transform_digest, bound_digest, 0 },
+    { OPT_MD5,
+        "Could not md5 digest data.\n",
+        transform_digest, bound_digest, 0 },
+    { OPT_BASE64,
+        "Could not base64 encode data.\n",
+        encode_base64, bound_base64, APR_ENCODE_NONE },
+    { OPT_BASE64URL,
+        "Could not base64url encode data.\n",
+        encode_base64, bound_base64, APR_ENCODE_URL },
+    { OPT_BASE64URL_NOPAD,
+        "Could not base64url encode data with no padding.\n",
+        encode_base64, bound_base64, APR_ENCODE_BASE64URL },
+    { OPT_DECODE_BASE64,
+        "Could not base64 decode data, bad characters encountered.\n",
+        decode_base64, bound_decode, APR_ENCODE_NONE },
+    { OPT_DECODE_BASE64_WRAPPED,
+        "Could not base64 decode wrapped data, bad characters encountered.\n",
+        decode_base64_wrapped, bound_decode, APR_ENCODE_NONE },
+    { OPT_BASE32,
+        "Could not base64 encode data.\n",
+        encode_base32, bound_base32, APR_ENCODE_NONE },
+    { OPT_BASE32HEX,
+        "Could not base32hex encode data.\n",
+        encode_base32, bound_base32, APR_ENCODE_BASE32HEX },
+    { OPT_BASE32HEX_NOPAD,
+        "Could not base32hex encode data with no padding.\n",
+        encode_base32, bound_base32,
+        APR_ENCODE_BASE32HEX | APR_ENCODE_NOPADDING },
+    { OPT_DECODE_BASE32,
+        "Could not base32 decode data, bad characters encountered.\n",
+        decode_base32, bound_decode, APR_ENCODE_NONE },
+    { OPT_DECODE_BASE32HEX,
+        "Could not base32hex decode data.\n",
+        decode_base32, bound_decode, APR_ENCODE_BASE32HEX },
+    { OPT_BASE16,
+        "Could not base16 encode data.\n",
+        encode_base16, bound_base16, APR_ENCODE_NONE },
+    { OPT_BASE16COLON,
+        "Could not base16 encode data separated with colons.\n",
+        encode_base16, bound_base16, APR_ENCODE_COLON },
+    { OPT_BASE16LOWER,
+        "Could not base16 encode data in lower case.\n",
+        encode_base16, bound_base16, APR_ENCODE_LOWER },
+    { OPT_BASE16COLONLOWER,
+        "Could not base16 encode data separated with colons in lower case.\n",
+        encode_base16, bound_base16,
+        APR_ENCODE_COLON | APR_ENCODE_LOWER },
+    { OPT_DECODE_BASE16,
+        "Could not base16 decode data, bad characters encountered.\n",
+        decode_base16, bound_decode, APR_ENCODE_NONE },
+    { OPT_BASE85,
+        "Could not base85 encode data.\n",
+        encode_base85, bound_base85, APR_ENCODE_NONE },
+    { OPT_DECODE_BASE85,
+        "Could not base85 decode data, bad characters encountered.\n",
+        decode_base85, bound_decode, APR_ENCODE_NONE },
+    { OPT_Z85,
+        "Could not z85 encode data.\n",
+        encode_base85, bound_base85, ENDEC_BASE85_Z85 },
+    { OPT_DECODE_Z85,
+        "Could not z85 decode data, bad characters encountered.\n",
+        decode_base85, bound_decode, ENDEC_BASE85_Z85 },
+    { OPT_ASCII85,
+        "Could not ascii85 encode data.\n",
+        encode_base85, bound_base85, ENDEC_BASE85_ASCII85 },
+    { OPT_DECODE_ASCII85,
+        "Could not ascii85 decode data, bad characters encountered.\n",
+        decode_base85, bound_decode, ENDEC_BASE85_ASCII85 },
+    { 0 }
+};
+
+/*
+ * JSON escapes a quote, a backslash and the control characters, with
+ * the short forms where there are any. APR has no JSON escape to ask.
+ */
+static void json_special(endec_stage_t *stage)
+{
+    static const char shorts[] = "\"\"\\\\\bb\ff\nn\rr\tt";
+    endec_replace_t *rep = stage->replace;
+    const char *s;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (i >= 0x20 && i != '"' && i != '\\') {
+            continue;
+        }
+
+        endec_class_add(&stage->special, i);
+
+        for (s = shorts; *s && *s != i; s += 2);
+        if (*s) {
+            rep->len[i] = 2;
+            rep->with[i][0] = '\\';
+            rep->with[i][1] = s[1];
+        }
+        else {
+            rep->len[i] = apr_snprintf(rep->with[i], ENDEC_REPLACE_MAX,
+                    "\\u%04x", i);
+        }
+    }
+}
+
+/*
+ * Work out which bytes an escape stage must act on. The escapes act on
+ * each byte alone, so APR is asked about each byte in turn, and what it
+ * writes is kept. Unescaping starts at the first byte of a sequence.
+ */
+static void escape_special(endec_stage_t *stage)
+{
+    endec_replace_t *rep = stage->replace;
+    char buf[ENDEC_REPLACE_MAX + 1];
+    const char *nul;
+    apr_size_t size;
+    char c[2] = { 0, 0 };
+    int i;
+
+    switch (stage->opt) {
+    case OPT_DECODE_URL: {
+        endec_class_add(&stage->special, '%');
+        return;
+    }
+    case OPT_DECODE_FORM: {
+        endec_class_add(&stage->special, '%');
+        endec_class_add(&stage->special, '+');
+        return;
+    }
+    case OPT_DECODE_ENTITY: {
+        endec_class_add(&stage->special, '&');
+        return;
+    }
+    case OPT_DECODE_JSON: {
+        endec_class_add(&stage->special, '\\');
+        return;
+    }
+    case OPT_JSON: {
+        json_special(stage);
+        return;
+    }
+    }
+
+    for (i = 0; i < 256; i++) {
+        c[0] = i;
+
+        /* the ldap escapes are given a length, and cope with a NUL */
+        if (!i && stage->opt != OPT_LDAP && stage->opt != OPT_LDAP_DN
+                && stage->opt != OPT_LDAP_FILTER) {
+            nul = escape_nul(stage);
+            if (nul) {
+                endec_class_add(&stage->special, 0);
+                rep->len[0] = strlen(nul);
+                memcpy(rep->with[0], nul, rep->len[0]);
+            }
+            continue;
+        }
+
+        if (escape_run(stage, NULL, c, 1, &size) != APR_NOTFOUND
+                && size <= sizeof(buf)) {
+            escape_run(stage, buf, c, 1, &size);
+            endec_class_add(&stage->special, i);
+            rep->len[i] = size - 1;
+            memcpy(rep->with[i], buf, size - 1);
+        }
+    }
+}
+
+endec_stage_t *endec_stage_make(apr_pool_t *pool, int opt)
+{
+    const stage_def_t *def;
+    endec_stage_t *stage;
+
+    for (def = stage_defs; def->opt && def->opt != opt; def++);
+    if (!def->opt) {
+        return NULL;
+    }
+
+    stage = apr_pcalloc(pool, sizeof(endec_stage_t));
+
+    stage->opt = opt;
+    stage->error = def->error;
+    stage->transform = def->transform;
+    stage->bound = def->bound;
+    stage->flags = def->flags;
+
+    if (stage->transform == transform_escape) {
+        stage->replace = apr_pcalloc(pool, sizeof(endec_replace_t));
+    }
+
+    if (stage->transform == transform_escape
+            || stage->transform == transform_unescape) {
+        escape_special(stage);
+    }
+
+    /* the whitespace a wrapped decoder skips */
+    if (stage->transform == decode_base64_wrapped) {
+        endec_class_add(&stage->special, ' ');
+        endec_class_add(&stage->special, '\t');
+        endec_class_add(&stage->special, '\r');
+        endec_class_add(&stage->special, '\n');
+    }
+
+    /* where the data went wrong is only known once it is seen */
+    if (stage->transform == transform_utf8) {
+        stage->message = apr_palloc(pool, ENDEC_MESSAGE_MAX);
+    }
+
+    if (stage->transform == transform_digest) {
+        stage->digest = apr_palloc(pool, sizeof(digest_ctx_t));
+    }
+
+    apr_pool_cleanup_register(pool, stage, cleanup_stage, cleanup_stage);
+
+    return stage;
+}
+
+apr_status_t endec_stage_wrap(endec_stage_t *stage, apr_size_t width)
+{
+    if (stage->transform != encode_base64) {
+        return APR_EINVAL;
+    }
+
+    stage->wrap = width;
+    stage->bound = width ? bound_wrap : bound_base64;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t cleanup_chain(void *dummy)
+{
+    endec_chain_t *chain = dummy;
+
+    free(chain->turn[0]);
+    free(chain->turn[1]);
+    free(chain->rec);
+    free(chain->obuf);
+
+    return APR_SUCCESS;
+}
+
+endec_chain_t *endec_chain_make(apr_pool_t *pool, apr_file_t *wr,
+        apr_size_t chunk)
+{
+    endec_chain_t *chain = apr_pcalloc(pool, sizeof(endec_chain_t));
+
+    chain->pool = pool;
+    chain->wr = wr;
+    chain->chunk = chunk;
+
+    apr_pool_cleanup_register(pool, chain, cleanup_chain, cleanup_chain);
+
+    return chain;
+}
+
+/*
+ * Decoders and the encoders that can share a pass with them.
+ */
+typedef struct fuse_def_t {
+    endec_transform_fn decode;
+    endec_transform_fn encode;
+    endec_transform_fn transform;
+} fuse_def_t;
+
+static const fuse_def_t fuse_defs[] = {
+    { decode_base64, encode_base16, transcode_base64 },
+    { decode_base64, encode_base64, transcode_base64 },
+    { decode_base16, encode_base64, transcode_base16 },
+    { NULL }
+};
+
+/*
+ * Can the stage work out the size of its output without making it?
+ */
+static int stage_discards(endec_stage_t *stage)
+{
+    return stage->transform == encode_base64
+            || stage->transform == encode_base32
+            || stage->transform == encode_base16
+            || stage->transform == decode_base64
+            || stage->transform == decode_base64_wrapped
+            || stage->transform == decode_base32
+            || stage->transform == decode_base16
+            || ((stage->transform == encode_base85
+                    || stage->transform == decode_base85)
+                    && !(stage->flags & ENDEC_BASE85_ASCII85))
+            || stage->transform == transform_escape;
+}
+
+endec_chain_t *endec_chain_tee(endec_chain_t *chain, apr_file_t *wr)
+{
+    endec_chain_t *branch = endec_chain_make(chain->pool, wr, chain->chunk);
+
+    /* the branches run one after the other, and so can share the pool */
+    branch->threads = chain->threads;
+#if APR_HAS_THREADS
+    branch->tp = chain->tp;
+    branch->mutex = chain->mutex;
+    branch->cond = chain->cond;
+    branch->pieces = chain->pieces;
+#endif
+
+    if (!chain->branches) {
+        chain->branches = apr_array_make(chain->pool, 4,
+                sizeof(endec_chain_t *));
+    }
+    APR_ARRAY_PUSH(chain->branches, endec_chain_t *) = branch;
+
+    return branch;
+}
+
+void endec_chain_count(endec_chain_t *chain)
+{
+    chain->count = 1;
+}
+
+void endec_chain_add(endec_chain_t *chain, endec_stage_t *stage)
+{
+    endec_stage_t *last = chain->last;
+    const fuse_def_t *def;
+
+    stage->chain = chain;
+
+    /*
+     * Join the encoder onto the decoder before it, unless only counting,
+     * or the encoder breaks its output into lines.
+     */
+    for (def = fuse_defs; last && !chain->count && !stage->wrap
+            && def->decode; def++) {
+        if (def->decode == last->transform
+                && def->encode == stage->transform) {
+            last->fused = stage;
+            last->transform = def->transform;
+            last->bound = bound_transcode;
+            return;
+        }
+    }
+
+    if (chain->last) {
+        chain->last->next = stage;
+    }
+    else {
+        chain->first = stage;
+    }
+    chain->last = stage;
+
+    /* the output of the last stage of a counting chain need not be made */
+    if (chain->count) {
+        if (last) {
+            last->discard = 0;
+        }
+        stage->discard = stage_discards(stage);
+    }
+}
+
+void endec_stats_begin(endec_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    stats->wall_start = apr_time_now();
+    stats->cpu_start = clock();
+}
+
+void endec_stats_end(endec_stats_t *stats, apr_size_t in, apr_size_t out)
+{
+    if (!stats) {
+        return;
+    }
+
+    stats->cpu += clock() - stats->cpu_start;
+    stats->wall += apr_time_now() - stats->wall_start;
+    stats->in += in;
+    stats->out += out;
+    stats->calls++;
+}
+
+void endec_chain_stats(endec_chain_t *chain)
+{
+    endec_stage_t *stage;
+    int i;
+
+    chain->rstats = apr_pcalloc(chain->pool, sizeof(endec_stats_t));
+    chain->wstats = apr_pcalloc(chain->pool, sizeof(endec_stats_t));
+
+    for (stage = chain->first; stage; stage = stage->next) {
+        stage->stats = apr_pcalloc(chain->pool, sizeof(endec_stats_t));
+    }
+
+    for (i = 0; chain->branches && i < chain->branches->nelts; i++) {
+        endec_chain_stats(APR_ARRAY_IDX(chain->branches, i, endec_chain_t *));
+    }
+}
+
+/*
+ * Pass the result to each branch in turn. The first branch to reject
+ * the data fails the chain.
+ */
+static apr_status_t chain_tee(endec_chain_t *chain, const char *data,
+        apr_size_t len, int eos)
+{
+    endec_chain_t *branch;
+    apr_status_t status;
+    int i;
+
+    for (i = 0; i < chain->branches->nelts; i++) {
+        branch = APR_ARRAY_IDX(chain->branches, i, endec_chain_t *);
+
+        status = endec_chain_write(branch, data, len, eos);
+        if (branch->failed) {
+            chain->failed = branch->failed;
+        }
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Write the result to the destination.
+ */
+static apr_status_t chain_file_write(endec_chain_t *chain, const char *data,
+        apr_size_t len)
+{
+    apr_size_t l;
+    apr_status_t status;
+
+    endec_stats_begin(chain->wstats);
+    status = apr_file_write_full(chain->wr, data, len, &l);
+    endec_stats_end(chain->wstats, l, 0);
+
+    return status;
+}
+
+/*
+ * Write out whatever output has been gathered.
+ */
+static apr_status_t chain_flush(endec_chain_t *chain)
+{
+    apr_status_t status;
+
+    /* captured output stays put until collected */
+    if (!chain->olen || chain->capture) {
+        return APR_SUCCESS;
+    }
+
+    status = chain_file_write(chain, chain->obuf, chain->olen);
+    chain->olen = 0;
+
+    return status;
+}
+
+/*
+ * Gather small pieces of output together into larger writes.
+ */
+static apr_status_t chain_output(endec_chain_t *chain, const char *data,
+        apr_size_t len)
+{
+    apr_status_t status;
+
+    if (chain->count) {
+        chain->total += len;
+        return APR_SUCCESS;
+    }
+
+    if (chain->capture) {
+        status = endec_reserve(&chain->obuf, &chain->osize,
+                chain->olen + len);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+        memcpy(chain->obuf + chain->olen, data, len);
+        chain->olen += len;
+        return APR_SUCCESS;
+    }
+
+    if (len > chain->osize - chain->olen) {
+        status = chain_flush(chain);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+        if (len >= chain->osize) {
+            return chain_file_write(chain, data, len);
+        }
+    }
+
+    memcpy(chain->obuf + chain->olen, data, len);
+    chain->olen += len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t stage_write(endec_chain_t *chain, endec_stage_t *stage,
+        const char *data, apr_size_t len, int eos)
+{
+    apr_status_t status;
+    int whole = (chain->chunk == APR_SIZE_MAX);
+
+    /* past the end of the chain, write the result */
+    if (!stage) {
+
+        if (chain->branches) {
+            return chain_tee(chain, data, len, eos);
+        }
+
+        if (chain->count) {
+            chain->total += len;
+            return APR_SUCCESS;
+        }
+
+        if (!len) {
+            return APR_SUCCESS;
+        }
+
+        if (chain->obuf || chain->capture) {
+            return chain_output(chain, data, len);
+        }
+
+        return chain_file_write(chain, data, len);
+    }
+
+    if (!len && !eos) {
+        return APR_SUCCESS;
+    }
+
+    do {
+        const char *in, *out = NULL;
+        apr_size_t inlen, outlen = 0, consumed = 0, n;
+        int last, turn = 0;
+
+        /* top up input left over from last time */
+        if (stage->len) {
+
+            /* a sequence longer than a chunk, make room for more */
+            if (stage->len == stage->size) {
+                status = endec_reserve(&stage->buf, &stage->size,
+                        stage->size * 2);
+                if (status != APR_SUCCESS) {
+                    return status;
+                }
+            }
+
+            n = stage->size - stage->len;
+            if (n > len) {
+                n = len;
+            }
+
+            if (n) {
+                memcpy(stage->buf + stage->len, data, n);
+                stage->len += n;
+            }
+
+            in = stage->buf;
+            inlen = stage->len;
+        }
+
+        /* otherwise transform the data where it lies */
+        else {
+
+            n = chain->chunk;
+            if (n > len) {
+                n = len;
+            }
+
+            in = data;
+            inlen = n;
+        }
+
+        data += n;
+        len -= n;
+        last = eos && !len;
+
+        /*
+         * Data passed through whole is done with by the time the stage
+         * after next runs, so the stages take turns with two buffers,
+         * each writing to the one not holding its input.
+         */
+        if (whole) {
+            turn = (in == chain->turn[0]);
+            stage->out = chain->turn[turn];
+            stage->outsize = chain->turnsize[turn];
+        }
+
+        if (stage->stats) {
+            endec_stats_begin(stage->stats);
+        }
+
+        status = stage->discard ? APR_SUCCESS : endec_reserve(&stage->out,
+                &stage->outsize, stage->bound(stage, inlen));
+        if (status == APR_SUCCESS) {
+            status = stage->transform(stage, in, inlen, last, &out, &outlen,
+                    &consumed);
+        }
+
+        if (stage->stats) {
+            endec_stats_end(stage->stats, consumed, outlen);
+        }
+
+        if (whole) {
+            chain->turn[turn] = stage->out;
+            chain->turnsize[turn] = stage->outsize;
+            stage->out = NULL;
+            stage->outsize = 0;
+        }
+
+        if (status != APR_SUCCESS || (last && consumed < inlen)) {
+            chain->failed = stage;
+            return status != APR_SUCCESS ? status : APR_INCOMPLETE;
+        }
+
+        status = stage_write(chain, stage->next, out, outlen, last);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        /*
+         * Keep what was not consumed for next time, once the output has
+         * gone, as the output may be the input passed on unchanged.
+         */
+        if (in == stage->buf) {
+            stage->len -= consumed;
+            memmove(stage->buf, stage->buf + consumed, stage->len);
+        }
+        else if (consumed < inlen) {
+            n = inlen - consumed;
+            status = endec_reserve(&stage->buf, &stage->size,
+                    n > chain->chunk ? n : chain->chunk);
+            if (status != APR_SUCCESS) {
+                return status;
+            }
+            memcpy(stage->buf, in + consumed, n);
+            stage->len = n;
+        }
+
+    } while (len);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_chain_threads(endec_chain_t *chain, int threads)
+{
+#if APR_HAS_THREADS
+    apr_status_t status;
+
+    if (threads < 2) {
+        return APR_SUCCESS;
+    }
+
+    if ((status = apr_thread_mutex_create(&chain->mutex,
+            APR_THREAD_MUTEX_DEFAULT, chain->pool)) != APR_SUCCESS
+            || (status = apr_thread_cond_create(&chain->cond,
+            chain->pool)) != APR_SUCCESS
+            || (status = apr_thread_pool_create(&chain->tp, threads - 1,
+            threads - 1, chain->pool)) != APR_SUCCESS) {
+        return status;
+    }
+
+    chain->pieces = apr_pcalloc(chain->pool, threads * sizeof(endec_piece_t));
+    chain->threads = threads;
+
+    return APR_SUCCESS;
+#else
+    return threads < 2 ? APR_SUCCESS : APR_ENOTIMPL;
+#endif
+}
+
+apr_status_t endec_chain_records(endec_chain_t *chain, char delim)
+{
+    chain->obuf = malloc(ENDEC_CHUNK_SIZE);
+    if (!chain->obuf) {
+        return APR_ENOMEM;
+    }
+    chain->osize = ENDEC_CHUNK_SIZE;
+
+    chain->records = 1;
+    chain->delim = delim;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Forget any state and data carried over from earlier data.
+ */
+static void stage_reset(endec_stage_t *stage)
+{
+    stage->state = 0;
+    stage->len = 0;
+    stage->seen = 0;
+
+    if (stage->fused) {
+        stage->fused->state = 0;
+    }
+}
+
+void endec_chain_capture(endec_chain_t *chain)
+{
+    chain->capture = 1;
+}
+
+void endec_chain_reset(endec_chain_t *chain)
+{
+    endec_stage_t *stage;
+
+    for (stage = chain->first; stage; stage = stage->next) {
+        stage_reset(stage);
+    }
+
+    chain->failed = NULL;
+    chain->reclen = 0;
+    chain->olen = 0;
+}
+
+/*
+ * Pass data through the stages. Data passed through whole has room made
+ * up front for the output of every stage, so that the shared buffers are
+ * sized once rather than grown stage by stage. The first, third and so on
+ * stages write to the first buffer, and the others to the second, so each
+ * buffer is sized for the stages that write to it. Should a stage pass its
+ * input on unchanged, the turns shift, and a buffer found short is grown
+ * as the stage runs.
+ */
+static apr_status_t chain_write(endec_chain_t *chain, const char *data,
+        apr_size_t len, int eos)
+{
+    endec_stage_t *stage;
+    apr_status_t status;
+    apr_size_t size = len, most[2] = { 0, 0 };
+    int turn = 0;
+
+    if (chain->chunk == APR_SIZE_MAX) {
+        for (stage = chain->first; stage && !stage->discard;
+                stage = stage->next, turn = !turn) {
+            size = stage->bound(stage, size);
+            if (size > most[turn]) {
+                most[turn] = size;
+            }
+        }
+        if ((status = endec_reserve(&chain->turn[0], &chain->turnsize[0],
+                most[0])) != APR_SUCCESS) {
+            return status;
+        }
+
+        /* with a single stage, the second buffer is left alone */
+        if (most[1] && (status = endec_reserve(&chain->turn[1],
+                &chain->turnsize[1], most[1])) != APR_SUCCESS) {
+            return status;
+        }
+    }
+
+    return stage_write(chain, chain->first, data, len, eos);
+}
+
+/*
+ * Pass one whole record through a freshly reset chain, and end the
+ * result with the delimiter.
+ */
+static apr_status_t record_write(endec_chain_t *chain, const char *data,
+        apr_size_t len)
+{
+    endec_stage_t *stage;
+    apr_status_t status;
+
+    /* the partial record and gathered output are left alone */
+    for (stage = chain->first; stage; stage = stage->next) {
+        stage_reset(stage);
+    }
+
+    status = chain_write(chain, data, len, 1);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    return chain_output(chain, &chain->delim, 1);
+}
+
+/*
+ * Split the data into records, carrying any partial record over to the
+ * next call.
+ */
+static apr_status_t records_write(endec_chain_t *chain, const char *data,
+        apr_size_t len, int eos)
+{
+    apr_status_t status = APR_SUCCESS;
+    const char *end;
+    apr_size_t n;
+
+    while (len) {
+
+        end = memchr(data, chain->delim, len);
+        n = end ? (apr_size_t)(end - data) : len;
+
+        /* join up with the start of the record from last time */
+        if (chain->reclen || !end) {
+            status = endec_reserve(&chain->rec, &chain->recsize,
+                    chain->reclen + n);
+            if (status != APR_SUCCESS) {
+                return status;
+            }
+            memcpy(chain->rec + chain->reclen, data, n);
+            chain->reclen += n;
+        }
+
+        if (!end) {
+            break;
+        }
+
+        if (chain->reclen) {
+            status = record_write(chain, chain->rec, chain->reclen);
+            chain->reclen = 0;
+        }
+        else {
+            status = record_write(chain, data, n);
+        }
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        data += n + 1;
+        len -= n + 1;
+    }
+
+    /* a final record need not be delimited */
+    if (eos && chain->reclen) {
+        status = record_write(chain, chain->rec, chain->reclen);
+        chain->reclen = 0;
+    }
+
+    return status;
+}
+
+apr_status_t endec_chain_write(endec_chain_t *chain, const char *data,
+        apr_size_t len, int eos)
+{
+    apr_status_t status, rv;
+
+    if (!chain->records) {
+        return chain_write(chain, data, len, eos);
+    }
+
+    status = records_write(chain, data, len, eos);
+
+    /* output for the records that went through is written regardless */
+    if (eos || status != APR_SUCCESS) {
+        rv = chain_flush(chain);
+        if (status == APR_SUCCESS) {
+            status = rv;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,125 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - decode and encode again in one pass
+ *
+ * The data is decoded a block at a time into a buffer small enough to
+ * stay in cache, and each block is encoded again straight away, so the
+ * decoded data never makes a trip through memory. Blocks decode to a
+ * whole number of base64 groups, so every block but the last encodes
+ * without padding, and the result matches decoding and encoding in two
+ * passes.
+ */
+
+#include <apr.h>
+#include <apr_encode.h>
+
+#include "config.h"
+#include "endec.h"
+
+/* bytes decoded and encoded again at a time, a whole number of groups */
+#define TRANSCODE_BLOCK 3072
+
+/*
+ * Decode blocks of iblock bytes with decode and encode the result with
+ * encode. With insep, each block but the last ends with the separator,
+ * which is checked and dropped. With outsep, the encoded blocks are
+ * joined with the separator. Padding at the end of the data is left to
+ * the last block.
+ */
+static apr_status_t transcode(char *dest, const char *src, apr_size_t slen,
+        endec_codec_fn decode, int dflags, apr_size_t iblock, char insep,
+        endec_codec_fn encode, int eflags, char outsep, apr_size_t *len)
+{
+    char buf[TRANSCODE_BLOCK];
+    apr_status_t status;
+    apr_size_t i = 0, tail = slen, total = 0, n, m;
+
+    while (tail && src[tail - 1] == '=') {
+        tail--;
+    }
+
+    do {
+        apr_size_t ilen = slen - i;
+
+        if (ilen > iblock && i + iblock <= tail) {
+            ilen = iblock;
+            if (insep && src[i + ilen - 1] != insep) {
+                return APR_BADCH;
+            }
+        }
+        else {
+            insep = 0;
+        }
+
+        status = decode(buf, src + i, ilen - (insep ? 1 : 0), dflags, &n);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+
+        if (n) {
+            if (outsep && total) {
+                dest[total++] = outsep;
+            }
+
+            status = encode(dest + total, buf, n, eflags, &m);
+            if (status != APR_SUCCESS) {
+                return status;
+            }
+            total += m;
+        }
+
+        i += ilen;
+
+    } while (i < slen);
+
+    *len = total;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t endec_base64_base16(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    return transcode(dest, src, slen, endec_decode_base64, APR_ENCODE_NONE,
+            TRANSCODE_BLOCK / 3 * 4, 0, endec_encode_base16, flags,
+            (flags & APR_ENCODE_COLON) ? ':' : 0, len);
+}
+
+apr_status_t endec_base64_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    return transcode(dest, src, slen, endec_decode_base64, APR_ENCODE_NONE,
+            TRANSCODE_BLOCK / 3 * 4, 0, endec_encode_base64, flags, 0, len);
+}
+
+apr_status_t endec_base16_base64(char *dest, const char *src,
+        apr_size_t slen, int flags, apr_size_t *len)
+{
+    int layout = flags & (ENDEC_BASE16_PLAIN | ENDEC_BASE16_COLON);
+
+    if (layout == ENDEC_BASE16_COLON) {
+        return transcode(dest, src, slen, endec_decode_base16, layout,
+                TRANSCODE_BLOCK * 3, ':', endec_encode_base64,
+                flags & ~layout, 0, len);
+    }
+
+    return transcode(dest, src, slen, endec_decode_base16, layout,
+            TRANSCODE_BLOCK * 2, 0, endec_encode_base64, flags & ~layout, 0,
+            len);
+}
@@ -0,0 +1,329 @@
+/**
+ *    Copyright (C) 2020 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * endec - UTF-8 validation kernels
+ *
+ * The vector kernels follow the lookup method of Keiser and Lemire, in
+ * which three table lookups on the nibbles of each byte and the byte
+ * before it find every invalid pair of bytes, and the bytes two and
+ * three back find the missing and extra continuation bytes. The kernels
+ * only say which block holds the first error, and the scalar code finds
+ * where in the block it lies.
+ */
+
+#include <apr.h>
+
+#include "config.h"
+#include "endec.h"
+
+#if ENDEC_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Check whole characters, returning the length of the valid data. When
+ * the data ends in a character cut short, cut is set.
+ */
+static apr_size_t valid_scalar(const unsigned char *src, apr_size_t slen,
+        int *cut)
+{
+    apr_size_t i = 0, n, k;
+    unsigned char lo, hi;
+
+    *cut = 0;
+
+    while (i < slen) {
+        unsigned char c = src[i];
+
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        /* the range of the second byte, the rest are 80 to BF */
+        lo = 0x80;
+        hi = 0xbf;
+        if (c < 0xc2) {
+            return i;
+        }
+        else if (c < 0xe0) {
+            n = 2;
+        }
+        else if (c < 0xf0) {
+            n = 3;
+            if (c == 0xe0) {
+                lo = 0xa0;
+            }
+            else if (c == 0xed) {
+                hi = 0x9f;
+            }
+        }
+        else if (c < 0xf5) {
+            n = 4;
+            if (c == 0xf0) {
+                lo = 0x90;
+            }
+            else if (c == 0xf4) {
+                hi = 0x8f;
+            }
+        }
+        else {
+            return i;
+        }
+
+        for (k = 1; k < n; k++) {
+            if (i + k == slen) {
+                *cut = 1;
+                return i;
+            }
+            if (src[i + k] < lo || src[i + k] > hi) {
+                return i;
+            }
+            lo = 0x80;
+            hi = 0xbf;
+        }
+
+        i += n;
+    }
+
+    return i;
+}
+
+#if ENDEC_X86
+
+#define TOO_SHORT 0x01
+#define TOO_LONG 0x02
+#define OVERLONG_3 0x04
+#define TOO_LARGE 0x08
+#define SURROGATE 0x10
+#define OVERLONG_2 0x20
+#define TOO_LARGE_1000 0x40
+#define OVERLONG_4 0x40
+#define TWO_CONTS 0x80
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* the errors each high nibble of the first byte of a pair can start */
+#define BYTE_1_HIGH \
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+        TOO_SHORT | OVERLONG_2, \
+        TOO_SHORT, \
+        TOO_SHORT | OVERLONG_3 | SURROGATE, \
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+/* the errors each low nibble of the first byte of a pair can start */
+#define BYTE_1_LOW \
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+        CARRY | OVERLONG_2, \
+        CARRY, \
+        CARRY, \
+        CARRY | TOO_LARGE, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+
+/* the errors each high nibble of the second byte of a pair can finish */
+#define BYTE_2_HIGH \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 \
+                | OVERLONG_4, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* the largest last three bytes of a block that leave nothing cut short */
+#define MAX_TAIL \
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+        (char)0xef, (char)0xdf, (char)0xbf
+
+/*
+ * Find the errors in a block, given the block before it.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i errors_sse41(__m128i in, __m128i prev)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1, prev2, prev3, sc, must;
+
+    prev1 = _mm_alignr_epi8(in, prev, 15);
+    prev2 = _mm_alignr_epi8(in, prev, 14);
+    prev3 = _mm_alignr_epi8(in, prev, 13);
+
+    sc = _mm_and_si128(_mm_and_si128(
+            _mm_shuffle_epi8(_mm_setr_epi8(BYTE_1_HIGH),
+                    _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(_mm_setr_epi8(BYTE_1_LOW),
+                    _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(_mm_setr_epi8(BYTE_2_HIGH),
+                    _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+    /* the third and fourth bytes of a character must be continuations */
+    must = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80)),
+            _mm_subs_epu8(prev3, _mm_set1_epi8(0xf0 - 0x80)));
+
+    return _mm_xor_si128(_mm_and_si128(must, _mm_set1_epi8((char)0x80)),
+            sc);
+}
+
+/*
+ * Check whole blocks, stopping at the first block holding an error.
+ * Returns the length checked, which always leaves at least a byte, and
+ * may end within a character.
+ */
+__attribute__((target("sse4.1")))
+static apr_size_t valid_sse41(const unsigned char *src, apr_size_t slen)
+{
+    const __m128i tail = _mm_setr_epi8(MAX_TAIL);
+    __m128i in, prev = _mm_setzero_si128(), cut = _mm_setzero_si128(), err;
+    apr_size_t i;
+
+    for (i = 0; slen - i > 16; i += 16) {
+
+        in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        /* ascii only has to finish the character before it */
+        if (!_mm_movemask_epi8(in)) {
+            err = cut;
+        }
+        else {
+            err = errors_sse41(in, prev);
+        }
+
+        if (!_mm_testz_si128(err, err)) {
+            break;
+        }
+
+        cut = _mm_subs_epu8(in, tail);
+        prev = in;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i errors_avx2(__m256i in, __m256i prev)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i before, prev1, prev2, prev3, sc, must;
+
+    /* the last bytes of the block before, then the start of this one */
+    before = _mm256_permute2x128_si256(prev, in, 0x21);
+    prev1 = _mm256_alignr_epi8(in, before, 15);
+    prev2 = _mm256_alignr_epi8(in, before, 14);
+    prev3 = _mm256_alignr_epi8(in, before, 13);
+
+    sc = _mm256_and_si256(_mm256_and_si256(
+            _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH),
+                    _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW),
+                    _mm256_and_si256(prev1, nibble))),
+            _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH),
+                    _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+    must = _mm256_or_si256(
+            _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80)),
+            _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80)));
+
+    return _mm256_xor_si256(_mm256_and_si256(must,
+            _mm256_set1_epi8((char)0x80)), sc);
+}
+
+__attribute__((target("avx2")))
+static apr_size_t valid_avx2(const unsigned char *src, apr_size_t slen)
+{
+    const __m256i tail = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, MAX_TAIL);
+    __m256i in, prev = _mm256_setzero_si256(), cut = _mm256_setzero_si256();
+    __m256i err;
+    apr_size_t i;
+
+    for (i = 0; slen - i > 32; i += 32) {
+
+        in = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        if (!_mm256_movemask_epi8(in)) {
+            err = cut;
+        }
+        else {
+            err = errors_avx2(in, prev);
+        }
+
+        if (!_mm256_testz_si256(err, err)) {
+            break;
+        }
+
+        cut = _mm256_subs_epu8(in, tail);
+        prev = in;
+    }
+
+    return i;
+}
+
+#endif
+
+static apr_size_t valid_none(const unsigned char *src, apr_size_t slen)
+{
+    return 0;
+}
+
+static apr_size_t (*valid_bulk)(const unsigned char *src,
+        apr_size_t slen) = valid_none;
+
+void endec_utf8_init(int cpu)
+{
+    valid_bulk = valid_none;
+
+#if ENDEC_X86
+    if (cpu & (ENDEC_CPU_AVX2 | ENDEC_CPU_AVX512)) {
+        valid_bulk = valid_avx2;
+    }
+    else if (cpu & ENDEC_CPU_SSE41) {
+        valid_bulk = valid_sse41;
+    }
+#endif
+}
+
+apr_size_t endec_utf8_valid(const char *src, apr_size_t slen, int *cut)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    apr_size_t n, p;
+
+    /*
+     * The blocks checked are valid up to their end, bar a character
+     * running on past it, so check again from the start of the last
+     * character.
+     */
+    n = valid_bulk(in, slen);
+    if (n) {
+        for (p = n - 1; p && (in[p] & 0xc0) == 0x80 && n - p < 4; p--);
+        n = p;
+    }
+
+    return n + valid_scalar(in + n, slen - n, cut);
+}